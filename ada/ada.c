@@ -1,5 +1,5 @@
-/* Adafruit 1110 LCD and button driver
- * built on mcp23s08 GPIO driver.
+/* Adafruit 1110 LCD and button driver,
+ * an I2C driver for the MCP23017 on the board.
  * (c) Lauri Pirttiaho, 2014
  */
 
@@ -15,10 +15,24 @@
 #include <linux/gpio.h>
 #include <linux/workqueue.h>
 #include <linux/i2c.h>
-#include <linux/spi/mcp23s08.h>
+#include <linux/of.h>
+#include <linux/kref.h>
+#include <linux/list.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
 #include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/bitmap.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/input.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "ada.h"
 
 /************************************************************
  * Module config
@@ -26,856 +40,4588 @@
 
 #define MODULE_NAME "ada"
 
+// Panels one module drives, /dev/adalcd0.../dev/adalcd7
+#define ADA_PANELS_MAX 8
+
 /************************************************************
- * Module data
+ * Statistics
  */
 
-static int gpiobase = 240;
+// Bus transactions by what they were for, latency histograms and
+// counters, per panel in debugfs ada/N/stats. Writing to
+// ada/N/reset zeroes them.
 
-module_param(gpiobase, int, 0444);
+enum port_path {
+  PATH_LCD_DATA,
+  PATH_LCD_CMD,
+  PATH_BACKLIGHT,
+  PATH_SCAN,
+  PATHS
+};
 
-/************************************************************
- * GPIO
- */
+static const char *const path_names[PATHS] = {
+  "lcd_data", "lcd_cmd", "backlight", "scan"
+};
 
-#define IN(pin) gpio_request_one(gpiobase+(pin), GPIOF_IN, #pin)
-#define DIN(pin) gpio_direction_input(gpiobase+(pin))
-#define OUT(pin) gpio_request_one(gpiobase+(pin), GPIOF_OUT_INIT_HIGH, #pin)
-#define OUTL(pin) gpio_request_one(gpiobase+(pin), GPIOF_OUT_INIT_LOW, #pin)
-#define DOUT(pin) gpio_direction_output(gpiobase+(pin))
-#define FREE(pin) gpio_free(gpiobase+(pin))
+// Groups of transfers taking turns on a bus, see Bus scheduler
+enum bus_class {
+  BUS_LCD,
+  BUS_SCAN,
+  BUS_CLASSES
+};
 
-#define SET(pin, value) gpio_set_value_cansleep(gpiobase+(pin), (value))
-#define GET(pin) gpio_get_value_cansleep(gpiobase+(pin))
+static const char *const bus_class_names[BUS_CLASSES] = {
+  "lcd", "scan"
+};
 
-/************************************************************
- * I2C client and mcp23s08 driver
- */
+struct bus_stats {
+  unsigned long groups;
+  unsigned long depth_sum; // Groups queued or on the bus before them
+  unsigned long depth_max;
+};
 
-static struct i2c_adapter* bus1;
-static struct i2c_client* cli32;
+struct path_stats {
+  unsigned long xfers;
+  unsigned long bytes;     // Register address and data
+  unsigned long errors;
+  u64 time_ns;
+};
 
-static void ioexpander_init(void)
-{
-  // This should detect errors and return them!
+// Bucket 0 is under 1 us, bucket b from 2^(b-1) us up to 2^b us,
+// the last one everything above
+#define HIST_BUCKETS 24
 
-  struct mcp23s08_platform_data mcp23017_pfdata = {
-    .chip = {
-      [0] = {
-	.is_present = 1,
-	.pullups = 0x001F /* pins [4:0] */
-      }
-    },
-    .base = gpiobase
-  };
+struct stat_hist {
+  unsigned long count;
+  u64 sum_ns;
+  u64 max_ns;
+  unsigned long bucket[HIST_BUCKETS];
+};
 
-  struct i2c_board_info mcp23017_info = {
-    .type = "mcp23017",
-    .addr = 32,
-    .platform_data = &mcp23017_pfdata
-  };
+struct ada_stats {
+  spinlock_t lock;
+  struct dentry *dir;
+
+  // All from here on is zeroed by reset
+  struct path_stats path[PATHS];
+  struct stat_hist flush_hist;   // flusher_work(), all of it
+  struct stat_hist press_hist;   // Press to but_read() return
+  struct bus_stats bus[BUS_CLASSES];
+  struct stat_hist bus_wait[BUS_CLASSES]; // bus_begin() until on the bus
+  unsigned long writes;          // lcd_write() calls
+  unsigned long flushes;
+  unsigned long scans;           // scan_buttons() calls
+
+  // Owned by their updaters, not under lock
+  unsigned long cells_skipped;
+  unsigned long glyph_hits;
+  unsigned long glyph_uploads;
+  unsigned long busy_polls;
+  unsigned long button_overflows;
+  unsigned long button_bounces;  // Pin changes debounce ignored
+  unsigned long backlight_merged; // Went out with an LCD transfer
+};
 
-  bus1 = i2c_get_adapter(1);
-  cli32 = i2c_new_device(bus1, &mcp23017_info); 
-}
+static struct dentry *stats_root;
 
-static void ioexpander_exit(void)
+static void stat_xfer(struct ada_stats *st, int path, int bytes, u64 start_ns, int err)
 {
-  if (cli32) {
-    i2c_unregister_device(cli32);
+  u64 ns = ktime_to_ns(ktime_get()) - start_ns;
+  unsigned long flags;
+
+  spin_lock_irqsave(&st->lock, flags);
+  struct path_stats *ps = &st->path[path];
+  ++ps->xfers;
+  ps->bytes += bytes;
+  ps->time_ns += ns;
+  if (err < 0) {
+    ++ps->errors;
   }
-  if (bus1) {
-    i2c_put_adapter(bus1);
+  spin_unlock_irqrestore(&st->lock, flags);
+}
+
+static void stat_hist_add(struct ada_stats *st, struct stat_hist *h, u64 ns)
+{
+  u64 us = div_u64(ns, NSEC_PER_USEC);
+  int b = us ? min(fls64(us), HIST_BUCKETS - 1) : 0;
+  unsigned long flags;
+
+  spin_lock_irqsave(&st->lock, flags);
+  ++h->count;
+  h->sum_ns += ns;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
   }
+  ++h->bucket[b];
+  spin_unlock_irqrestore(&st->lock, flags);
 }
 
-/************************************************************
- * Button control
- */
+static void stat_count(struct ada_stats *st, unsigned long *counter)
+{
+  unsigned long flags;
 
-// Buttons (5 buttons of the Adafruit 1110)
-#define SELECT 0
-#define RIGHT  1
-#define DOWN   2
-#define UP     3
-#define LEFT   4
+  spin_lock_irqsave(&st->lock, flags);
+  ++*counter;
+  spin_unlock_irqrestore(&st->lock, flags);
+}
 
-static void buttons_init(void)
+static void stat_bus_wait(struct ada_stats *st, int class, int depth, u64 ns)
 {
-  IN(SELECT);
-  IN(RIGHT);
-  IN(DOWN);
-  IN(UP);
-  IN(LEFT);
+  unsigned long flags;
+
+  spin_lock_irqsave(&st->lock, flags);
+  struct bus_stats *bs = &st->bus[class];
+  ++bs->groups;
+  bs->depth_sum += depth;
+  if (depth > bs->depth_max) {
+    bs->depth_max = depth;
+  }
+  spin_unlock_irqrestore(&st->lock, flags);
+
+  stat_hist_add(st, &st->bus_wait[class], ns);
 }
 
-static void buttons_exit(void)
+static void stats_show_hist(struct seq_file *m, const char *name,
+			    const struct stat_hist *h)
 {
-  FREE(SELECT);
-  FREE(RIGHT);
-  FREE(DOWN);
-  FREE(UP);
-  FREE(LEFT);
+  seq_printf(m, "%s_us count %lu avg %llu max %llu\n", name, h->count,
+	     h->count ? div_u64(div64_u64(h->sum_ns, h->count), NSEC_PER_USEC) : 0,
+	     div_u64(h->max_ns, NSEC_PER_USEC));
+
+  for (int b = 0; b < HIST_BUCKETS; ++b) {
+    if (!h->bucket[b]) continue;
+    if (b == HIST_BUCKETS - 1) {
+      seq_printf(m, "  %8lu -         %lu\n", 1UL << (b - 1), h->bucket[b]);
+    } else {
+      seq_printf(m, "  %8lu - %8lu %lu\n",
+		 b ? 1UL << (b - 1) : 0, 1UL << b, h->bucket[b]);
+    }
+  }
 }
 
-/************************************************************
- * Backlights
- */
+static int stats_show(struct seq_file *m, void *v)
+{
+  struct ada_stats *st = m->private;
+  struct path_stats ps[PATHS];
+  struct stat_hist flush, press;
+  struct bus_stats bus[BUS_CLASSES];
+  struct stat_hist bus_wait[BUS_CLASSES];
+  unsigned long writes, flushes, scans;
+  unsigned long flags;
+
+  // Copy first, printing may sleep
+  spin_lock_irqsave(&st->lock, flags);
+  memcpy(ps, st->path, sizeof(ps));
+  flush = st->flush_hist;
+  press = st->press_hist;
+  memcpy(bus, st->bus, sizeof(bus));
+  memcpy(bus_wait, st->bus_wait, sizeof(bus_wait));
+  writes = st->writes;
+  flushes = st->flushes;
+  scans = st->scans;
+  spin_unlock_irqrestore(&st->lock, flags);
+
+  seq_printf(m, "%-10s %10s %10s %8s %12s\n",
+	     "path", "xfers", "bytes", "errors", "time_us");
+  for (int i = 0; i < PATHS; ++i) {
+    seq_printf(m, "%-10s %10lu %10lu %8lu %12llu\n", path_names[i],
+	       ps[i].xfers, ps[i].bytes, ps[i].errors,
+	       div_u64(ps[i].time_ns, NSEC_PER_USEC));
+  }
 
-// LEDs (3 back-light leds of the Adafruit 1110)
-#define RED   6
-#define GREEN 7
-#define BLUE  8
+  seq_printf(m, "writes %lu\nflushes %lu\nscans %lu\n",
+	     writes, flushes, scans);
+  seq_printf(m, "cells_skipped %lu\nglyph_hits %lu\nglyph_uploads %lu\n",
+	     ACCESS_ONCE(st->cells_skipped), ACCESS_ONCE(st->glyph_hits),
+	     ACCESS_ONCE(st->glyph_uploads));
+  seq_printf(m, "busy_polls %lu\nbutton_overflows %lu\n",
+	     ACCESS_ONCE(st->busy_polls), ACCESS_ONCE(st->button_overflows));
+  seq_printf(m, "button_bounces %lu\n", ACCESS_ONCE(st->button_bounces));
+  seq_printf(m, "backlight_merged %lu\n", ACCESS_ONCE(st->backlight_merged));
+
+  seq_printf(m, "%-10s %10s %10s %10s\n",
+	     "bus", "groups", "depth_avg", "depth_max");
+  for (int i = 0; i < BUS_CLASSES; ++i) {
+    seq_printf(m, "%-10s %10lu %10lu %10lu\n", bus_class_names[i],
+	       bus[i].groups, bus[i].groups ? bus[i].depth_sum / bus[i].groups : 0,
+	       bus[i].depth_max);
+  }
+
+  stats_show_hist(m, "flush", &flush);
+  stats_show_hist(m, "press_to_read", &press);
+  stats_show_hist(m, "bus_wait_lcd", &bus_wait[BUS_LCD]);
+  stats_show_hist(m, "bus_wait_scan", &bus_wait[BUS_SCAN]);
+
+  return 0;
+}
 
-static void bl_init(void)
+static int stats_open(struct inode *inode, struct file *filp)
 {
-  OUT(RED);
-  OUT(GREEN);
-  OUT(BLUE);
+  return single_open(filp, stats_show, inode->i_private);
 }
 
-static void bl_exit(void)
+static struct file_operations stats_fileops = {
+  .owner = THIS_MODULE,
+  .open = stats_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+static ssize_t stats_reset_write(struct file *filp, const char __user *ubuff,
+				 size_t len, loff_t *offs)
 {
-  DIN(RED);
-  DIN(GREEN);
-  DIN(BLUE);
+  struct ada_stats *st = filp->private_data;
+  unsigned long flags;
+
+  spin_lock_irqsave(&st->lock, flags);
+  memset(st->path, 0, sizeof(*st) - offsetof(struct ada_stats, path));
+  spin_unlock_irqrestore(&st->lock, flags);
 
-  FREE(RED);
-  FREE(GREEN);
-  FREE(BLUE);
+  return len;
 }
 
-static void bl_color_set(int rgb)
+static struct file_operations stats_reset_fileops = {
+  .owner = THIS_MODULE,
+  .open = simple_open,
+  .write = stats_reset_write
+};
+
+// Statistics are kept anyway, a missing debugfs only hides them
+static void stats_root_init(void)
 {
-  if ((rgb & 0x000000ff) > 0x0000007f) {
-    SET(BLUE, 0);
-  } else {
-    SET(BLUE, 1);
-  }
-  if ((rgb & 0x0000ff00) > 0x00007f00) {
-    SET(GREEN, 0);
-  } else {
-    SET(GREEN, 1);
-  }
-  if ((rgb & 0x00ff0000) > 0x007f0000) {
-    SET(RED, 0);
-  } else {
-    SET(RED, 1);
+  stats_root = debugfs_create_dir(MODULE_NAME, NULL);
+  if (IS_ERR_OR_NULL(stats_root)) {
+    printk(KERN_ALERT MODULE_NAME ": no debugfs, statistics not shown\n");
+    stats_root = NULL;
   }
 }
 
-int bl_color = 0;
+static void stats_root_exit(void)
+{
+  debugfs_remove_recursive(stats_root);
+  stats_root = NULL;
+}
 
-static int bl_set(const char *val, const struct kernel_param *kp)
+static void stats_init(struct ada_stats *st, int index)
 {
-  int color;
+  char name[16];
 
-  int n_read = sscanf(val, "0x%x", &color);
-  if (n_read != 1) return -EINVAL;
+  spin_lock_init(&st->lock);
+  if (!stats_root) return;
 
-  bl_color = color;
-  bl_color_set(color);
+  snprintf(name, sizeof(name), "%d", index);
+  st->dir = debugfs_create_dir(name, stats_root);
+  if (IS_ERR_OR_NULL(st->dir)) {
+    st->dir = NULL;
+    return;
+  }
 
-  return 0;
+  debugfs_create_file("stats", 0444, st->dir, st, &stats_fileops);
+  debugfs_create_file("reset", 0200, st->dir, st, &stats_reset_fileops);
 }
 
-static int bl_get(char *val, const struct kernel_param *kp)
+static void stats_exit(struct ada_stats *st)
 {
-  return sprintf(val, "0x%08x", bl_color);
+  debugfs_remove_recursive(st->dir);
+  st->dir = NULL;
 }
 
-static struct kernel_param_ops bl_ops = {
-  .set = bl_set,
-  .get = bl_get
-};
-
-module_param_cb(backlight_color, &bl_ops, &bl_color, 0644);
-
 /************************************************************
- * Button scanner
+ * Panels
  */
 
-static int buttons_before;
-
-static int button_events;
-static spinlock_t button_events_sl;
-static wait_queue_head_t but_readq;
+// Everything of one panel: its expander, buttons, cells and the
+// work keeping the panel up to date. Panels come from the I2C
+// core as ada1110 devices, see I2C driver, or are mock panels.
+// Each has workqueues of its own so panels on different buses are
+// refreshed in parallel.
 
-module_param(button_events, int, 0644);
+#define LCD_BUFFER_LENGTH ADA_LCD_CELLS
 
-static void scan_buttons(void)
-{
-  int buttons_now = 0;
+// Virtual screens, each with cells of its own. The overlay comes
+// after the last possible screen.
+#define LCD_SCREENS_MAX ADA_LCD_SCREENS_MAX
+#define LCD_OVERLAY LCD_SCREENS_MAX
 
-  for (int i = 0; i < 5; ++i) {
-    buttons_now |= GET(i) << i;
-  }
+struct lcd_size {
+  int characters;
+  int lines;
+};
 
-  int new_events = (buttons_before & ~buttons_now) & 0x1F;
+// See Custom glyphs
+#define LCD_GLYPH_SLOTS 8
 
-  spin_lock(&button_events_sl);
-  button_events |= new_events;
-  spin_unlock(&button_events_sl);
+struct lcd_glyph {
+  u64 bitmap;
+  unsigned long used;      // lcd_glyph_clock at last use
+  bool valid;
+};
 
-  if (new_events) {
-    wake_up_interruptible(&but_readq);
-  }
+// See Button scanner
+#define BUTTON_RING_SIZE 64
 
-  buttons_before = buttons_now;
-}
+struct button_timing {
+  u64 changed_ns;          // Last change taken, for debounce
+  u64 long_ns;             // When LONG is due, 0 for never
+  u64 repeat_ns;           // When the next REPEAT is due, 0 for never
+};
 
-// Scanning work queue. Timer won't work since GPIO calls
-// may block which is not allowed in timer's interrupt
-// context!
+// Longest burst: an 80 character line with an address command
+// for every character at worst, four latch values per byte
+#define PORT_BURST_MAX (4 * 2 * 80)
+
+struct port_backend;
+struct ada_mock;
+struct ada_bus;
+
+struct ada {
+  struct kref ref;         // Open files hold one too
+  int index;               // N of /dev/adalcdN and /dev/adabutN
+  struct i2c_client *client;  // NULL for a mock panel
+  const struct port_backend *backend;
+  bool backend_up;
+  struct ada_mock *mock;
+  struct ada_bus *bus;     // Shared with the panels on the same bus
+  bool gone;               // Removed, only open files hold it
+  struct ada_stats stats;
+
+  // Port access
+  struct mutex port_lock;
+  u16 port_latch;
+  u8 port_iodirb;
+  bool port_ready;
+  bool port_flushing;
+  u16 port_merge;          // Latch bits waiting for a transfer
+  u16 port_merge_mask;
+  bool burst;
+  u8 port_burst_buf[1 + 2 * PORT_BURST_MAX];
+
+  // Buttons
+  struct input_dev *button_input;
+  char button_phys[32];
+  struct mutex button_lock;  // Held by the producer, see Button scanner
+  int buttons_before;      // Debounced pins, low when held
+  int buttons_raw;         // Pins as last read
+  struct button_timing button_timing[5];
+  wait_queue_head_t but_readq;
+  struct fasync_struct *but_fasync_queue;
+  struct ada_button_event button_ring[BUTTON_RING_SIZE];
+  unsigned int button_head;
+  unsigned int button_tail;
+  struct mutex but_read_lock;
+  int but_readers;         // Open files of /dev/adabutN, under but_read_lock
+  int button_irq;
+  u64 button_irq_time;
+  struct workqueue_struct *scanner_q;
+  struct delayed_work scanner_w;
+
+  // LCD buffer
+  char *lcd_buffer;
+  struct lcd_size lcd_size;
+  unsigned int marquee;
+  struct mutex lcd_lock;
+  DECLARE_BITMAP(lcd_dirty, LCD_BUFFER_LENGTH);
+  unsigned long lcd_gen;
+  unsigned long lcd_screen_gen[LCD_OVERLAY + 1];
+  bool lcd_resync;
+  int lcd_active;
+  bool lcd_overlay_on;
+
+  // Owned by the flush worker
+  char lcd_frame[LCD_BUFFER_LENGTH];
+  DECLARE_BITMAP(lcd_frame_dirty, LCD_BUFFER_LENGTH);
+  struct lcd_size lcd_frame_size;
+  unsigned int lcd_frame_marquee;
+  char lcd_shadow[LCD_BUFFER_LENGTH];
+  bool lcd_shadow_valid;
+  bool lcd_shadow_wide;
+  int lcd_shift;
+
+  // Custom glyphs
+  struct lcd_glyph lcd_glyphs[LCD_GLYPH_SLOTS];
+  unsigned long lcd_glyph_clock;
+  unsigned long lcd_glyph_dirty;
+
+  // Display flush
+  struct workqueue_struct *flusher_q;
+  struct delayed_work flusher_w;
+  unsigned long flush_last;
+  int flush_error;
+  unsigned long lcd_gen_shown;
+  wait_queue_head_t lcd_flushq;
+  bool lcd_ready;
+  wait_queue_head_t lcd_readyq;
+  wait_queue_head_t lcd_changeq;
+  struct fasync_struct *lcd_fasync_queue;
+  struct delayed_work marquee_w;
+  struct work_struct lcd_init_w;
+
+  struct device *lcd_dev;
+  struct device *but_dev;
+};
 
-static struct workqueue_struct* scanner_q;
-static struct delayed_work scanner_w;
+// Panels by index. Module parameters that change every panel walk
+// this under ada_panels_lock, opens look their panel up here.
+static struct ada *ada_panels[ADA_PANELS_MAX];
+static DEFINE_MUTEX(ada_panels_lock);
 
-// Scanning frequency in Hz
-#define SCAN_FRQ 50
+static void ada_release(struct kref *ref);
 
-static void scanner_work(struct work_struct *work)
+// Panel index with a reference held, NULL if there is none
+static struct ada *ada_get(int index)
 {
-  scan_buttons();
-  PREPARE_DELAYED_WORK(&scanner_w, scanner_work);
-  queue_delayed_work(scanner_q, &scanner_w, HZ/SCAN_FRQ);
+  struct ada *ada = NULL;
+
+  if (index < 0 || index >= ADA_PANELS_MAX) return NULL;
+
+  mutex_lock(&ada_panels_lock);
+  ada = ada_panels[index];
+  if (ada) {
+    kref_get(&ada->ref);
+  }
+  mutex_unlock(&ada_panels_lock);
+
+  return ada;
 }
 
-static void scanner_init(void)
+// Panel with the lowest index, for the parameters that show or
+// use one panel
+static struct ada *ada_get_first(void)
 {
-  buttons_before = 0x1F;
-  button_events = 0;
-  spin_lock_init(&button_events_sl);
+  struct ada *ada = NULL;
+
+  mutex_lock(&ada_panels_lock);
+  for (int i = 0; i < ADA_PANELS_MAX && !ada; ++i) {
+    ada = ada_panels[i];
+  }
+  if (ada) {
+    kref_get(&ada->ref);
+  }
+  mutex_unlock(&ada_panels_lock);
 
-  scanner_q = alloc_workqueue(MODULE_NAME "_q", WQ_UNBOUND, 1);
-  INIT_DELAYED_WORK(&scanner_w, scanner_work);
-  queue_delayed_work(scanner_q, &scanner_w, HZ/SCAN_FRQ);
+  return ada;
 }
 
-static void scanner_exit(void)
+static void ada_put(struct ada *ada)
 {
-  cancel_delayed_work_sync(&scanner_w);
-  flush_workqueue(scanner_q);
-  destroy_workqueue(scanner_q);
+  kref_put(&ada->ref, ada_release);
 }
 
 /************************************************************
- * Button file ops
+ * Expander backends
  */
 
-static int but_open(struct inode *inode, struct file *filp)
-{
-  filp->private_data = 0; // Event read flag
-  return 0;
-}
+// MCP23017 registers (IOCON.BANK = 0, as after reset)
+#define MCP_IODIRA 0x00
+#define MCP_IODIRB 0x01
+#define MCP_GPINTENA 0x04
+#define MCP_INTCONA 0x08
+#define MCP_IOCON 0x0A
+#define MCP_GPPUA 0x0C
+#define MCP_INTCAPA 0x10
+#define MCP_GPIOA 0x12
+#define MCP_GPIOB 0x13
+#define MCP_OLATA 0x14
+#define MCP_OLATB 0x15
+
+#define IOCON_SEQOP 0x20
+
+// Everything reaches the expander's registers through the
+// backend of the panel: the MCP23017 of an ada1110 I2C device, or
+// mock, an emulated expander in memory for running without a
+// panel.
+struct port_backend {
+  const char *name;
+  int (*init)(struct ada *ada);
+  void (*exit)(struct ada *ada);
+  int (*read_byte)(struct ada *ada, u8 reg);
+  int (*read_word)(struct ada *ada, u8 reg);
+  int (*write_byte)(struct ada *ada, u8 reg, u8 value);
+  int (*write_word)(struct ada *ada, u8 reg, u16 value);
+  // buf[0] is the first register, returns the bytes sent
+  int (*write_burst)(struct ada *ada, const u8 *buf, int len);
+  // Wait at least ms, may sleep
+  void (*delay_ms)(struct ada *ada, unsigned int ms);
+};
 
-static ssize_t but_read(
-    struct file *filp, char __user *ubuff, size_t len, loff_t *offs)
-{
-  int ret = 0;
-  char buffer[32];
+// Panels created at module load: mcp23017 for the one at i2c_bus
+// and i2c_addr, mock for mock_panels mock panels
+static char *backend = "mcp23017";
 
-  if (filp->private_data) {
-    filp->private_data = 0;
-    return 0;
-  }
+module_param(backend, charp, 0444);
 
-  ret = wait_event_interruptible_exclusive(but_readq, button_events);
-  
-  // Wake up from interrupts, try again
-  if (ret) return -ERESTARTSYS;
+/* MCP23017 */
 
-  filp->private_data = (void*) 1;
-  len = 1;
+// The client comes from the I2C core, just see that the chip
+// answers
+static int mcp23017_init(struct ada *ada)
+{
+  int iocon = i2c_smbus_read_byte_data(ada->client, MCP_IOCON);
+  return iocon < 0 ? iocon : 0;
+}
 
-  // Return first event and clear it
-  spin_lock(&button_events_sl);
-  for (int i = 0; i < 5; ++i) {
-    if (button_events & (1<<i)) {
-      buffer[0] = '0'+i;
-      button_events &= ~(1<<i);
-      break;
-    }
-  }
-  spin_unlock(&button_events_sl);
+static void mcp23017_exit(struct ada *ada)
+{
+}
 
-  int uncopied = copy_to_user(ubuff, buffer, len);
+static int mcp23017_read_byte(struct ada *ada, u8 reg)
+{
+  return i2c_smbus_read_byte_data(ada->client, reg);
+}
 
-  if (uncopied) {
-    ret = -EFAULT;
-  } else {
-    ret = len;
-  }
+static int mcp23017_read_word(struct ada *ada, u8 reg)
+{
+  return i2c_smbus_read_word_data(ada->client, reg);
+}
 
-  return ret;
+static int mcp23017_write_byte(struct ada *ada, u8 reg, u8 value)
+{
+  return i2c_smbus_write_byte_data(ada->client, reg, value);
 }
 
-static ssize_t but_write(struct file *filp, const char __user *ubuff, size_t len, loff_t *offs)
+static int mcp23017_write_word(struct ada *ada, u8 reg, u16 value)
 {
-  return -EPERM;
+  return i2c_smbus_write_word_data(ada->client, reg, value);
 }
 
-static int but_release(struct inode *inode, struct file *filp)
+static int mcp23017_write_burst(struct ada *ada, const u8 *buf, int len)
 {
-  return 0;
+  return i2c_master_send(ada->client, buf, len);
 }
 
-static struct file_operations but_fileops = {
-  .owner = THIS_MODULE,
-  .open = but_open,
-  .read = but_read,
-  .write = but_write,
-  .release = but_release
+static void mcp23017_delay_ms(struct ada *ada, unsigned int ms)
+{
+  usleep_range(ms * USEC_PER_MSEC, ms * USEC_PER_MSEC + 500);
+}
+
+static const struct port_backend mcp23017_backend = {
+  .name = "mcp23017",
+  .init = mcp23017_init,
+  .exit = mcp23017_exit,
+  .read_byte = mcp23017_read_byte,
+  .read_word = mcp23017_read_word,
+  .write_byte = mcp23017_write_byte,
+  .write_word = mcp23017_write_word,
+  .write_burst = mcp23017_write_burst,
+  .delay_ms = mcp23017_delay_ms
 };
 
-/************************************************************
- * LCD buffer
- */
+/* Mock */
 
-#define LCD_BUFFER_LENGTH 80
+// Registers of an emulated MCP23017. Writes to OLATx or GPIOx set
+// the output latches and every change of the 16 latch bits is
+// recorded in the trace and fed to the HD44780 model. GPIOA reads
+// the buttons from mock_buttons (all released, high, by default)
+// and the latches elsewhere. There is no interrupt.
+#define MOCK_REGS 0x16
+#define MOCK_TRACE_SIZE 1024
+#define MOCK_BUTTON_PINS 0x1F  // GPA0-GPA4
 
-static char lcd_buffer[LCD_BUFFER_LENGTH] =
-"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ9876543210zyxwvuts";
+// Mock panels created at module load with backend=mock
+static int mock_panels = 1;
 
-static struct lcd_size {
-  int characters;
-  int lines;
-} lcd_size = { 16, 2 };
+module_param(mock_panels, int, 0444);
 
-static int output_display(char *output_buffer, const char *display_buffer)
-{
-  switch (lcd_size.lines) {
-  case 1:
-    strncpy(output_buffer, display_buffer, lcd_size.characters);
-    output_buffer[lcd_size.characters] = '\n';
-    return lcd_size.characters+1;
-    break;
-  case 2:
-    strncpy(output_buffer, display_buffer, lcd_size.characters);
-    output_buffer[lcd_size.characters] = '\n';
-    strncpy(output_buffer+lcd_size.characters+1, display_buffer+40, lcd_size.characters);
-    output_buffer[2 * lcd_size.characters + 1] = '\n';
-    return 2 * lcd_size.characters + 2;
-    break;
-  case 4:
-    strncpy(output_buffer, display_buffer, lcd_size.characters);
-    output_buffer[lcd_size.characters] = '\n';
-    strncpy(output_buffer+lcd_size.characters+1, display_buffer+20, lcd_size.characters);
-    output_buffer[2 * lcd_size.characters + 1] = '\n';
-    strncpy(output_buffer+2*lcd_size.characters+2, display_buffer+40, lcd_size.characters);
-    output_buffer[3 * lcd_size.characters + 2] = '\n';
-    strncpy(output_buffer+3*lcd_size.characters+3, display_buffer+60, lcd_size.characters);
-    output_buffer[4 * lcd_size.characters + 3] = '\n';
-    return 4 * lcd_size.characters + 4;
-    break;
-  default:
-    break;
-  }
-  return 0;
-}
+// Buttons of every mock panel. Pressing is writing a 0 bit,
+// ADA_BUTTON_SELECT is bit 0
+static u8 mock_buttons = 0x1F;
 
-static int size_set(const char *val, const struct kernel_param *kp)
-{
-  int characters = 0;
-  int lines = 0;
+module_param(mock_buttons, byte, 0644);
 
-  int n_read = sscanf(val, "%dx%d", &characters, &lines);
-  if (n_read != 2) return -EINVAL;
+struct mock_transition {
+  u64 time_ns;
+  u16 latch;
+};
 
-  if (lines != 1 && lines != 2 && lines != 4) return -EINVAL;
-  if (characters <= 0 || characters > 80) return -EINVAL;
-  if (lines*characters > 80) return -EINVAL;
+// What the transfers would take on a real bus: every byte is 9
+// clocks with the ack, plus start and stop, a read also repeats
+// the start and the address
+struct mock_bus {
+  unsigned long xfers;
+  u64 clocks;
+};
 
-  struct lcd_size *ls = kp->arg;
-  ls->characters = characters;
-  ls->lines = lines;
+static unsigned int mock_i2c_khz = 100;
+
+module_param(mock_i2c_khz, uint, 0644);
+
+// The HD44780 model, see there
+#define MOCK_DDRAM 128
+#define MOCK_CGRAM 64
+
+struct mock_lcd {
+  u8 ddram[MOCK_DDRAM];
+  u8 cgram[MOCK_CGRAM];
+  u8 ac;
+  bool ac_cgram;           // Address counter points to CGRAM
+  bool increment;
+  bool shift_on_write;
+  bool four_bit;
+  bool two_lines;
+  bool display_on;
+  int shift;               // Display shifted left, 0...39
+  bool low_nybble;         // Waiting for the second nybble
+  u8 high;
+
+  unsigned long cmds;
+  unsigned long datas;
+  unsigned long reads;
+};
 
-  return 0;
-}
+struct ada_mock {
+  u8 regs[MOCK_REGS];
+  spinlock_t lock;
+  struct mock_transition trace[MOCK_TRACE_SIZE];
+  unsigned long transitions;
+  struct mock_bus bus;
+  struct mock_lcd lcd;
+
+  // Counted from here on, see mock_lcd_reset_write()
+  struct mock_bus bus_base;
+  unsigned long flushes_base;
+};
 
-static int size_get(char *val, const struct kernel_param *kp)
+static void mock_lcd_edge(struct mock_lcd *l, u16 before, u16 after);
+static u16 mock_lcd_pins(const struct mock_lcd *l, u16 latch, u8 iodirb);
+static void mock_lcd_init(struct ada *ada);
+
+static void mock_bus_xfer(struct ada_mock *mk, int bytes, bool read)
 {
-  struct lcd_size *ls = kp->arg;
-  return sprintf(val, "%dx%d", ls->characters, ls->lines);
+  spin_lock(&mk->lock);
+  ++mk->bus.xfers;
+  mk->bus.clocks += 9 * bytes + 2 + (read ? 1 + 9 : 0);
+  spin_unlock(&mk->lock);
 }
 
-static int display_set(const char *val, const struct kernel_param *kp)
+static u64 mock_bus_ns(u64 clocks)
 {
-  // Do nothing!
-  return -EPERM;
+  unsigned int khz = mock_i2c_khz ? mock_i2c_khz : 100;
+  return div_u64(clocks * NSEC_PER_MSEC, khz);
 }
 
-static int display_get(char *val, const struct kernel_param *kp)
+static u16 mock_latch(struct ada_mock *mk)
 {
-  return output_display(val, (char *)kp->arg);
+  return mk->regs[MCP_OLATA] | mk->regs[MCP_OLATA + 1] << 8;
 }
 
-static struct kernel_param_ops size_ops = {
-  .set = size_set,
-  .get = size_get
-};
-
-static struct kernel_param_ops display_ops = {
-  .set = display_set,
-  .get = display_get
-};
+static void mock_write_reg(struct ada_mock *mk, u8 reg, u8 value)
+{
+  if (reg >= MOCK_REGS) return;
 
-module_param_cb(lcd_size, &size_ops, &lcd_size, 0644);
-module_param_cb(display, &display_ops, lcd_buffer, 0644);
+  // Writing GPIOx writes OLATx
+  if (reg == MCP_GPIOA || reg == MCP_GPIOA + 1) {
+    reg += MCP_OLATA - MCP_GPIOA;
+  }
 
-/************************************************************
- * HD44780U (KS0066U) driver
- */
+  spin_lock(&mk->lock);
+  u16 before = mock_latch(mk);
+  mk->regs[reg] = value;
+  u16 after = mock_latch(mk);
+
+  if (after != before) {
+    struct mock_transition *t = &mk->trace[mk->transitions % MOCK_TRACE_SIZE];
+    t->time_ns = ktime_to_ns(ktime_get());
+    t->latch = after;
+    ++mk->transitions;
+    mock_lcd_edge(&mk->lcd, before, after);
+  }
+  spin_unlock(&mk->lock);
+}
 
-// LCD pins
-#define LCD_RS 15
-#define LCD_RW 14
-#define LCD_E  13
-#define LCD_D4 12
-#define LCD_D5 11
-#define LCD_D6 10
-#define LCD_D7  9
+static int mock_read_reg(struct ada_mock *mk, u8 reg)
+{
+  if (reg >= MOCK_REGS) return -EINVAL;
+
+  switch (reg) {
+  case MCP_GPIOA:
+  case MCP_INTCAPA:
+    return (mk->regs[MCP_OLATA] & ~MOCK_BUTTON_PINS) | (mock_buttons & MOCK_BUTTON_PINS);
+  case MCP_GPIOB: {
+    // The controller drives its data pins during a read
+    spin_lock(&mk->lock);
+    u16 pins = mock_lcd_pins(&mk->lcd, mock_latch(mk), mk->regs[MCP_IODIRB]);
+    spin_unlock(&mk->lock);
+    return pins >> 8;
+  }
+  default:
+    return mk->regs[reg];
+  }
+}
 
-static void lcd_write_nybble(int n)
+static int mock_read_byte(struct ada *ada, u8 reg)
 {
-  SET(LCD_D4, (n>>0) & 1);
-  SET(LCD_D5, (n>>1) & 1);
-  SET(LCD_D6, (n>>2) & 1);
-  SET(LCD_D7, (n>>3) & 1);
-  SET(LCD_E, 1);
-  SET(LCD_E, 0);
+  mock_bus_xfer(ada->mock, 3, true);
+  return mock_read_reg(ada->mock, reg);
 }
 
-static void lcd_write_byte(int b)
+static int mock_read_word(struct ada *ada, u8 reg)
 {
-  lcd_write_nybble(b>>4);
-  lcd_write_nybble(b>>0);
+  mock_bus_xfer(ada->mock, 4, true);
+
+  int lo = mock_read_reg(ada->mock, reg);
+  int hi = mock_read_reg(ada->mock, reg + 1);
+  if (lo < 0) return lo;
+  if (hi < 0) return hi;
+  return lo | hi << 8;
 }
 
-static void lcd_write_data(int b)
+static int mock_write_byte(struct ada *ada, u8 reg, u8 value)
 {
-  SET(LCD_RS, 1);
-  lcd_write_byte(b);
+  mock_bus_xfer(ada->mock, 3, false);
+  mock_write_reg(ada->mock, reg, value);
+  return 0;
 }
 
-static void lcd_write_cmd(int b)
+static int mock_write_word(struct ada *ada, u8 reg, u16 value)
 {
-  SET(LCD_RS, 0);
-  lcd_write_byte(b);
+  mock_bus_xfer(ada->mock, 4, false);
+  mock_write_reg(ada->mock, reg, value & 0xFF);
+  mock_write_reg(ada->mock, reg + 1, value >> 8);
+  return 0;
 }
 
-static void lcd_init(void)
+// Sequential writes: the address increments, or with IOCON.SEQOP
+// toggles between the A and B register of a pair
+static int mock_write_burst(struct ada *ada, const u8 *buf, int len)
 {
-  OUTL(LCD_RS);
-  OUTL(LCD_RW);
-  OUTL(LCD_E);
-  OUTL(LCD_D4);
-  OUTL(LCD_D5);
-  OUTL(LCD_D6);
-  OUTL(LCD_D7);
+  struct ada_mock *mk = ada->mock;
+  u8 reg = buf[0];
 
-  lcd_write_nybble(3);
-  mdelay(4);
-  lcd_write_nybble(3);
-  // lcd writes taek longer than the required delays
-  lcd_write_nybble(3);
-  lcd_write_nybble(2);
+  mock_bus_xfer(mk, 1 + len, false);
 
-  lcd_write_cmd(0x28); // 2 lines 5x8 font
-  lcd_write_cmd(0x0C); // Display on
-  lcd_write_cmd(0x06); // Cursor moves right
-  lcd_write_cmd(0x01); // Clear
+  for (int i = 1; i < len; ++i) {
+    mock_write_reg(mk, reg, buf[i]);
+    if (mk->regs[MCP_IOCON] & IOCON_SEQOP) {
+      reg ^= 1;
+    } else {
+      ++reg;
+    }
+  }
+  return len;
 }
 
-static void lcd_exit(void)
+static void mock_delay_ms(struct ada *ada, unsigned int ms)
 {
-  FREE(LCD_D7);
-  FREE(LCD_D6);
-  FREE(LCD_D5);
-  FREE(LCD_D4);
-  FREE(LCD_E);
-  FREE(LCD_RW);
-  FREE(LCD_RS);
 }
 
-static const int line_starts[] = {0, 64, 20, 84};
-static void lcd_copy_line(int line)
+static int mock_trace_show(struct seq_file *m, void *v)
 {
-  lcd_write_cmd(0x80 + line_starts[line]);
-  int line_offset = 20;
-  if (lcd_size.lines == 2) {
-    line_offset = 40;
-  }
-  for (int i = 0; i < lcd_size.characters; ++i) {
-    lcd_write_data(lcd_buffer[i + line * line_offset]);
+  struct ada_mock *mk = m->private;
+  unsigned long flags;
+
+  spin_lock_irqsave(&mk->lock, flags);
+  unsigned long total = mk->transitions;
+  unsigned long first = total > MOCK_TRACE_SIZE ? total - MOCK_TRACE_SIZE : 0;
+  spin_unlock_irqrestore(&mk->lock, flags);
+
+  seq_printf(m, "transitions %lu\n", total);
+
+  // Oldest first, entries may be overwritten while printing
+  for (unsigned long i = first; i < total; ++i) {
+    struct mock_transition t = mk->trace[i % MOCK_TRACE_SIZE];
+    seq_printf(m, "%llu %04x\n", (unsigned long long)t.time_ns, t.latch);
   }
+
+  return 0;
 }
 
-static void lcd_write_to_panel(void)
+static int mock_trace_open(struct inode *inode, struct file *filp)
 {
-  for (int i = 0; i < lcd_size.lines; ++i) {
-    lcd_copy_line(i);
-  }
+  return single_open(filp, mock_trace_show, inode->i_private);
 }
 
-/************************************************************
- * Write stream parser
- */
+static struct file_operations mock_trace_fileops = {
+  .owner = THIS_MODULE,
+  .open = mock_trace_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = single_release
+};
 
-#define NCOLS lcd_size.characters
-#define NROWS lcd_size.lines
+static int mock_init(struct ada *ada)
+{
+  struct ada_mock *mk = kzalloc(sizeof(*mk), GFP_KERNEL);
+  if (!mk) return -ENOMEM;
 
-/* Parser state */
+  spin_lock_init(&mk->lock);
+  mk->regs[MCP_IODIRA] = 0xFF;  // All inputs after reset
+  mk->regs[MCP_IODIRB] = 0xFF;
+  ada->mock = mk;
+  mock_lcd_init(ada);
 
-typedef struct write_stream_parser {
-  int col;
-  int row;
-  int clear_from;
-  int clear_count;
-  int ansi_n;
-  int ansi_m;
-  const char *buffer;
-  size_t len;
-  int index;
-  void (*state_fn) (struct write_stream_parser *);
-} write_stream_parser_t;
+  if (ada->stats.dir) {
+    debugfs_create_file("mock_trace", 0444, ada->stats.dir, mk, &mock_trace_fileops);
+  }
+
+  return 0;
+}
+
+// Only once nothing touches the port any more
+static void mock_exit(struct ada *ada)
+{
+  kfree(ada->mock);
+  ada->mock = NULL;
+}
+
+static const struct port_backend mock_backend = {
+  .name = "mock",
+  .init = mock_init,
+  .exit = mock_exit,
+  .read_byte = mock_read_byte,
+  .read_word = mock_read_word,
+  .write_byte = mock_write_byte,
+  .write_word = mock_write_word,
+  .write_burst = mock_write_burst,
+  .delay_ms = mock_delay_ms
+};
+
+/* Selection */
+
+static const struct port_backend *const port_backends[] = {
+  &mcp23017_backend,
+  &mock_backend
+};
+
+static const struct port_backend *port_backend = &mcp23017_backend;
+
+static int port_backend_select(void)
+{
+  for (int i = 0; i < ARRAY_SIZE(port_backends); ++i) {
+    if (!strcmp(backend, port_backends[i]->name)) {
+      port_backend = port_backends[i];
+      return 0;
+    }
+  }
+
+  printk(KERN_ALERT MODULE_NAME ": unknown backend %s\n", backend);
+  return -EINVAL;
+}
+
+static int port_backend_init(struct ada *ada)
+{
+  int err = ada->backend->init(ada);
+  ada->backend_up = !err;
+
+  return err;
+}
+
+static void port_backend_exit(struct ada *ada)
+{
+  if (ada->backend_up) {
+    ada->backend->exit(ada);
+  }
+  ada->backend_up = false;
+}
+
+static void port_delay(struct ada *ada, unsigned int ms)
+{
+  ada->backend->delay_ms(ada, ms);
+}
+
+/************************************************************
+ * Bus scheduler
+ */
+
+// Panels on one I2C bus take turns on it in groups of transfers:
+// a byte or a line of the display, a button scan. A group holds
+// the bus so that nothing lands in its middle and stretches it.
+// Scans go first, a queued scan makes new LCD groups wait and
+// long LCD groups step aside in bus_yield(), so a scan waits for
+// one LCD byte or burst at most. The mock panels share one bus.
+
+struct ada_bus {
+  struct list_head node;   // In ada_buses
+  int nr;                  // Adapter number, -1 for the mock
+  int users;               // Panels, under ada_buses_lock
+  struct mutex lock;       // Held by the group on the bus
+  struct task_struct *owner;
+  int depth;               // Groups the owner started, nested
+  spinlock_t queue_lock;
+  int queued[BUS_CLASSES]; // Waiting or on the bus
+  wait_queue_head_t scanq; // LCD groups waiting for scans to go
+};
+
+static LIST_HEAD(ada_buses);
+static DEFINE_MUTEX(ada_buses_lock);
+
+static struct ada_bus *bus_get(int nr)
+{
+  struct ada_bus *bus;
+
+  mutex_lock(&ada_buses_lock);
+
+  list_for_each_entry(bus, &ada_buses, node) {
+    if (bus->nr == nr) {
+      ++bus->users;
+      goto out;
+    }
+  }
+
+  bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+  if (!bus) goto out;
+
+  bus->nr = nr;
+  bus->users = 1;
+  mutex_init(&bus->lock);
+  spin_lock_init(&bus->queue_lock);
+  init_waitqueue_head(&bus->scanq);
+  list_add_tail(&bus->node, &ada_buses);
+
+ out:
+  mutex_unlock(&ada_buses_lock);
+
+  return bus;
+}
+
+static void bus_put(struct ada_bus *bus)
+{
+  mutex_lock(&ada_buses_lock);
+  if (--bus->users == 0) {
+    list_del(&bus->node);
+    kfree(bus);
+  }
+  mutex_unlock(&ada_buses_lock);
+}
+
+// Start a group of transfers of class on the bus of the panel.
+// Groups nest, a group started by the owner of the bus is part of
+// the one in progress.
+static void bus_begin(struct ada *ada, int class)
+{
+  struct ada_bus *bus = ada->bus;
+
+  if (ACCESS_ONCE(bus->owner) == current) {
+    ++bus->depth;
+    return;
+  }
+
+  u64 start = ktime_to_ns(ktime_get());
+
+  spin_lock(&bus->queue_lock);
+  int depth = bus->queued[BUS_LCD] + bus->queued[BUS_SCAN];
+  ++bus->queued[class];
+  spin_unlock(&bus->queue_lock);
+
+  if (class == BUS_LCD) {
+    wait_event(bus->scanq, ACCESS_ONCE(bus->queued[BUS_SCAN]) == 0);
+  }
+
+  mutex_lock(&bus->lock);
+  bus->owner = current;
+  bus->depth = 1;
+
+  stat_bus_wait(&ada->stats, class, depth, ktime_to_ns(ktime_get()) - start);
+}
+
+static void bus_end(struct ada *ada, int class)
+{
+  struct ada_bus *bus = ada->bus;
+
+  if (--bus->depth) return;
+
+  bus->owner = NULL;
+  mutex_unlock(&bus->lock);
+
+  spin_lock(&bus->queue_lock);
+  bool scans_gone = --bus->queued[class] == 0 && class == BUS_SCAN;
+  spin_unlock(&bus->queue_lock);
+
+  if (scans_gone) {
+    wake_up_all(&bus->scanq);
+  }
+}
+
+// Let queued scans in between two steps of an LCD group, where
+// the controller doesn't mind a pause
+static void bus_yield(struct ada *ada)
+{
+  struct ada_bus *bus = ada->bus;
+
+  if (bus->owner != current || bus->depth != 1 ||
+      !ACCESS_ONCE(bus->queued[BUS_SCAN])) {
+    return;
+  }
+
+  bus_end(ada, BUS_LCD);
+  bus_begin(ada, BUS_LCD);
+}
+
+static int bus_class(int path)
+{
+  return path == PATH_SCAN ? BUS_SCAN : BUS_LCD;
+}
+
+/************************************************************
+ * Port access
+ */
+
+// The output latches are kept here and written straight to the
+// expander, one transaction per update no matter how many pins
+// change. ada owns the expander, nothing else writes it.
+
+#define PIN(pin) (1 << (pin))
+
+// Burst mode streams latch values in one I2C transfer, see
+// port_burst(). Off by default, then everything goes through
+// port_write().
+static bool burst;
+
+module_param(burst, bool, 0444);
+
+// With IOCON.SEQOP set the register address no longer increments
+// but toggles between the A and B register of a pair. Word
+// accesses only go to register pairs so they are unaffected.
+static int port_burst_init(struct ada *ada)
+{
+  int iocon = ada->backend->read_byte(ada, MCP_IOCON);
+  if (iocon < 0) return iocon;
+
+  return ada->backend->write_byte(ada, MCP_IOCON, iocon | IOCON_SEQOP);
+}
+
+static void port_burst_exit(struct ada *ada)
+{
+  int iocon = ada->backend->read_byte(ada, MCP_IOCON);
+  if (iocon < 0) return;
+
+  ada->backend->write_byte(ada, MCP_IOCON, iocon & ~IOCON_SEQOP);
+}
+
+// Set up both ports: the output latches first so that no output
+// glitches, then the pull-ups and the directions, inputs as 1 bits
+static int port_init(struct ada *ada, u16 latch, u16 inputs, u16 pullups)
+{
+  if (!ada->backend_up) return -ENODEV;
+
+  int err = ada->backend->write_word(ada, MCP_OLATA, latch);
+  if (!err) {
+    err = ada->backend->write_word(ada, MCP_GPPUA, pullups);
+  }
+  if (!err) {
+    err = ada->backend->write_word(ada, MCP_IODIRA, inputs);
+  }
+  if (err) return err;
+
+  ada->port_latch = latch;
+  ada->port_iodirb = inputs >> 8;
+  ada->port_ready = true;
+
+  ada->burst = burst;
+  if (ada->burst && port_burst_init(ada)) {
+    printk(KERN_ALERT MODULE_NAME "%d: burst mode not available\n", ada->index);
+    ada->burst = false;
+  }
+
+  return 0;
+}
+
+// Turn the pins in release back into inputs
+static void port_exit(struct ada *ada, u16 release)
+{
+  mutex_lock(&ada->port_lock);
+  if (ada->port_ready) {
+    if (ada->burst) {
+      port_burst_exit(ada);
+    }
+    int iodir = ada->backend->read_word(ada, MCP_IODIRA);
+    if (iodir >= 0) {
+      ada->backend->write_word(ada, MCP_IODIRA, iodir | release);
+    }
+  }
+  ada->port_ready = false;
+  mutex_unlock(&ada->port_lock);
+}
+
+// The latch with the bits waiting in port_merge, see
+// port_merge_set(). With port_lock held.
+static u16 port_latch_merged(struct ada *ada)
+{
+  return (ada->port_latch & ~ada->port_merge_mask) |
+    (ada->port_merge & ada->port_merge_mask);
+}
+
+// The merged bits are out, with port_lock held
+static void port_merged(struct ada *ada, int path)
+{
+  if (ada->port_merge_mask && path != PATH_BACKLIGHT) {
+    ++ada->stats.backlight_merged;
+  }
+  ada->port_merge_mask = 0;
+}
+
+// Set the pins in mask to value. Only the ports that actually
+// change are written, both of them in one word write if needed.
+// path tells what the write is for, see Statistics.
+static int port_write(struct ada *ada, int path, u16 mask, u16 value)
+{
+  int err = 0;
+
+  bus_begin(ada, bus_class(path));
+  mutex_lock(&ada->port_lock);
+
+  u16 latch = (port_latch_merged(ada) & ~mask) | (value & mask);
+  u16 changed = latch ^ ada->port_latch;
+  u64 start = ktime_to_ns(ktime_get());
+
+  if (!ada->port_ready) {
+    err = -ENODEV;
+  } else if ((changed & 0x00FF) && (changed & 0xFF00)) {
+    err = ada->backend->write_word(ada, MCP_OLATA, latch);
+    stat_xfer(&ada->stats, path, 3, start, err);
+  } else if (changed & 0x00FF) {
+    err = ada->backend->write_byte(ada, MCP_OLATA, latch & 0xFF);
+    stat_xfer(&ada->stats, path, 2, start, err);
+  } else if (changed & 0xFF00) {
+    err = ada->backend->write_byte(ada, MCP_OLATB, latch >> 8);
+    stat_xfer(&ada->stats, path, 2, start, err);
+  }
+
+  if (!err) {
+    ada->port_latch = latch;
+    port_merged(ada, path);
+  }
+
+  mutex_unlock(&ada->port_lock);
+  bus_end(ada, bus_class(path));
+
+  return err;
+}
+
+// Set the pins in mask to value with the next transfer of the
+// flusher if it is at work, on their own otherwise. Changes of the
+// backlights ride along with the LCD this way, port_burst()
+// rewrites port A between every two values anyway.
+static int port_merge_set(struct ada *ada, u16 mask, u16 value)
+{
+  mutex_lock(&ada->port_lock);
+  ada->port_merge = (ada->port_merge & ~mask) | (value & mask);
+  ada->port_merge_mask |= mask;
+  bool later = ada->port_flushing;
+  mutex_unlock(&ada->port_lock);
+
+  if (later) return 0;
+
+  return port_write(ada, PATH_BACKLIGHT, 0, 0);
+}
+
+// Around the transfers of a flush. Bits still waiting at the end
+// go out on their own.
+static void port_flush_begin(struct ada *ada)
+{
+  mutex_lock(&ada->port_lock);
+  ada->port_flushing = true;
+  mutex_unlock(&ada->port_lock);
+}
+
+static void port_flush_end(struct ada *ada)
+{
+  mutex_lock(&ada->port_lock);
+  ada->port_flushing = false;
+  bool waiting = ada->port_merge_mask != 0;
+  mutex_unlock(&ada->port_lock);
+
+  if (waiting) {
+    port_write(ada, PATH_BACKLIGHT, 0, 0);
+  }
+}
+
+// Turn the port B pins in mask into inputs, or back to outputs.
+// port_iodirb is the copy of IODIRB the other writes go by.
+static int port_input_b(struct ada *ada, int path, u8 mask, bool input)
+{
+  int err = 0;
+
+  bus_begin(ada, bus_class(path));
+  mutex_lock(&ada->port_lock);
+
+  u8 iodirb = input ? ada->port_iodirb | mask : ada->port_iodirb & ~mask;
+  u64 start = ktime_to_ns(ktime_get());
+
+  if (!ada->port_ready) {
+    err = -ENODEV;
+  } else if (iodirb != ada->port_iodirb) {
+    err = ada->backend->write_byte(ada, MCP_IODIRB, iodirb);
+    stat_xfer(&ada->stats, path, 2, start, err);
+  }
+
+  if (!err) {
+    ada->port_iodirb = iodirb;
+  }
+
+  mutex_unlock(&ada->port_lock);
+  bus_end(ada, bus_class(path));
+
+  return err;
+}
+
+// Read a whole port register, e.g. all pins of port A from GPIOA
+static int port_read(struct ada *ada, int path, u8 reg)
+{
+  if (!ada->port_ready) return -ENODEV;
+
+  bus_begin(ada, bus_class(path));
+  u64 start = ktime_to_ns(ktime_get());
+  int ret = ada->backend->read_byte(ada, reg);
+  stat_xfer(&ada->stats, path, 2, start, ret);
+  bus_end(ada, bus_class(path));
+
+  return ret;
+}
+
+// Write n successive values of the port B pins in mask in a single
+// I2C transfer. The address toggles between OLATB and OLATA so
+// every other byte rewrites port A with its current value, or the
+// one waiting to be merged.
+static int port_burst(struct ada *ada, int path, u8 mask, const u8 *values, int n)
+{
+  int err = 0;
+
+  if (n <= 0) return 0;
+  if (n > PORT_BURST_MAX) return -EINVAL;
+
+  bus_begin(ada, bus_class(path));
+  mutex_lock(&ada->port_lock);
+
+  if (!ada->port_ready) {
+    err = -ENODEV;
+    goto out;
+  }
+
+  u16 latch = port_latch_merged(ada);
+  u8 keep_b = (latch >> 8) & ~mask;
+  u8 latch_a = latch & 0xFF;
+  u8 *p = ada->port_burst_buf;
+
+  *p++ = MCP_OLATB;
+  for (int i = 0; i < n; ++i) {
+    *p++ = keep_b | (values[i] & mask);
+    *p++ = latch_a;
+  }
+
+  // No need to rewrite port A after the last value
+  int len = p - ada->port_burst_buf - 1;
+  u64 start = ktime_to_ns(ktime_get());
+  int sent = ada->backend->write_burst(ada, ada->port_burst_buf, len);
+  stat_xfer(&ada->stats, path, len, start, sent);
+
+  if (sent < 0) {
+    err = sent;
+  } else if (sent != len) {
+    err = -EIO;
+  } else {
+    ada->port_latch = latch_a | (u16)ada->port_burst_buf[len - 1] << 8;
+    port_merged(ada, path);
+  }
+
+ out:
+  mutex_unlock(&ada->port_lock);
+  bus_end(ada, bus_class(path));
+
+  return err;
+}
+
+/************************************************************
+ * Button control
+ */
+
+// Buttons (5 buttons of the Adafruit 1110)
+#define SELECT 0
+#define RIGHT  1
+#define DOWN   2
+#define UP     3
+#define LEFT   4
+
+#define BUTTON_PINS (PIN(SELECT) | PIN(RIGHT) | PIN(DOWN) | PIN(UP) | PIN(LEFT))
+
+/************************************************************
+ * Backlights
+ */
+
+// LEDs (3 back-light leds of the Adafruit 1110)
+#define RED   6
+#define GREEN 7
+#define BLUE  8
+
+#define BL_PINS (PIN(RED) | PIN(GREEN) | PIN(BLUE))
+
+// LEDs are active low, all three go out in one port write
+static void bl_color_set(struct ada *ada, int rgb)
+{
+  u16 value = 0;
+
+  if ((rgb & 0x000000ff) <= 0x0000007f) {
+    value |= PIN(BLUE);
+  }
+  if ((rgb & 0x0000ff00) <= 0x00007f00) {
+    value |= PIN(GREEN);
+  }
+  if ((rgb & 0x00ff0000) <= 0x007f0000) {
+    value |= PIN(RED);
+  }
+
+  port_merge_set(ada, BL_PINS, value);
+}
+
+// Of every panel
+int bl_color = 0;
+
+static int bl_set(const char *val, const struct kernel_param *kp)
+{
+  int color;
+
+  int n_read = sscanf(val, "0x%x", &color);
+  if (n_read != 1) return -EINVAL;
+
+  mutex_lock(&ada_panels_lock);
+  bl_color = color;
+  for (int i = 0; i < ADA_PANELS_MAX; ++i) {
+    if (ada_panels[i]) {
+      bl_color_set(ada_panels[i], color);
+    }
+  }
+  mutex_unlock(&ada_panels_lock);
+
+  return 0;
+}
+
+static int bl_get(char *val, const struct kernel_param *kp)
+{
+  return sprintf(val, "0x%08x", bl_color);
+}
+
+static struct kernel_param_ops bl_ops = {
+  .set = bl_set,
+  .get = bl_get
+};
+
+module_param_cb(backlight_color, &bl_ops, &bl_color, 0644);
+
+/************************************************************
+ * Button input device
+ */
+
+// The buttons are also keys of an input device so that evdev
+// readers get them with the usual queueing and fan-out
+
+static const unsigned short button_keys[] = {
+  [SELECT] = KEY_SELECT,
+  [RIGHT]  = KEY_RIGHT,
+  [DOWN]   = KEY_DOWN,
+  [UP]     = KEY_UP,
+  [LEFT]   = KEY_LEFT
+};
+
+static int button_input_init(struct ada *ada)
+{
+  struct input_dev *input = input_allocate_device();
+  if (!input) return -ENOMEM;
+
+  input->name = "Adafruit 1110 buttons";
+  snprintf(ada->button_phys, sizeof(ada->button_phys), MODULE_NAME "/input%d", ada->index);
+  input->phys = ada->button_phys;
+  input->id.bustype = BUS_I2C;
+  if (ada->client) {
+    input->dev.parent = &ada->client->dev;
+  }
+
+  for (int i = 0; i < ARRAY_SIZE(button_keys); ++i) {
+    input_set_capability(input, EV_KEY, button_keys[i]);
+  }
+
+  int err = input_register_device(input);
+  if (err) {
+    input_free_device(input);
+    return err;
+  }
+
+  ada->button_input = input;
+
+  return 0;
+}
+
+static void button_input_exit(struct ada *ada)
+{
+  if (ada->button_input) {
+    input_unregister_device(ada->button_input);
+    ada->button_input = NULL;
+  }
+}
+
+/************************************************************
+ * Button scanner
+ */
+
+// Button events go from the button engine, run by the scanner or
+// the IRQ thread under button_lock, to readers through a ring. The
+// producer only moves button_head and readers only button_tail
+// (under but_read_lock), so the two never wait for each other.
+// Events arriving to a full ring are dropped and counted. With no
+// reader the ring fills with stale events, the first one to open
+// starts from an empty ring.
+
+static void button_event_push(struct ada *ada, u64 time_ns, int button, int type, int state)
+{
+  unsigned int head = ada->button_head;
+
+  if (head - ACCESS_ONCE(ada->button_tail) >= BUTTON_RING_SIZE) {
+    ++ada->stats.button_overflows;
+    return;
+  }
+
+  struct ada_button_event *ev = &ada->button_ring[head % BUTTON_RING_SIZE];
+  ev->time_ns = time_ns;
+  ev->button = button;
+  ev->type = type;
+  ev->state = state;
+
+  // Event must be visible before the new head
+  smp_wmb();
+  ACCESS_ONCE(ada->button_head) = head + 1;
+}
+
+// Debounce, long press and auto-repeat, of all panels. A pin
+// change of a button within debounce_ms of its last one is a bounce
+// and ignored, the pin is looked at again once that time is over.
+// Long press and repeat are the LONG and REPEAT events of ada.h,
+// 0 turns either of them off.
+static unsigned int debounce_ms = 10;
+static unsigned int long_press_ms;
+static unsigned int repeat_delay_ms;
+static unsigned int repeat_rate = 10;   // Repeats a second
+
+module_param(debounce_ms, uint, 0644);
+module_param(long_press_ms, uint, 0644);
+module_param(repeat_delay_ms, uint, 0644);
+module_param(repeat_rate, uint, 0644);
+
+// Chords that step through the virtual screens
+#define CHORD_SCREEN_NEXT (PIN(ADA_BUTTON_SELECT) | PIN(ADA_BUTTON_RIGHT))
+#define CHORD_SCREEN_PREV (PIN(ADA_BUTTON_SELECT) | PIN(ADA_BUTTON_LEFT))
+
+static void lcd_show_step(struct ada *ada, int step);
+
+// Times are 0 for never
+static bool button_due(u64 due_ns, u64 now_ns)
+{
+  return due_ns && (s64)(now_ns - due_ns) >= 0;
+}
+
+static u64 button_sooner(u64 a_ns, u64 b_ns)
+{
+  if (!a_ns) return b_ns;
+  if (!b_ns) return a_ns;
+  return (s64)(a_ns - b_ns) < 0 ? a_ns : b_ns;
+}
+
+// To the ring and the input device, which knows only presses,
+// releases and repeats (value 2 as with autorepeat)
+static void button_event(struct ada *ada, u64 time_ns, int button, int type, int held)
+{
+  button_event_push(ada, time_ns, button, type, held);
+
+  if (!ada->button_input) return;
+
+  switch (type) {
+  case ADA_BUTTON_RELEASE:
+  case ADA_BUTTON_PRESS:
+    input_report_key(ada->button_input, button_keys[button], type == ADA_BUTTON_PRESS);
+    break;
+  case ADA_BUTTON_REPEAT:
+    input_event(ada->button_input, EV_KEY, button_keys[button], 2);
+    break;
+  }
+}
+
+// Pin changes debounce lets through, returns the buttons changed
+static int buttons_debounce(struct ada *ada, int buttons_now, u64 time_ns)
+{
+  u64 debounce_ns = (u64)ACCESS_ONCE(debounce_ms) * NSEC_PER_MSEC;
+  int changed = 0;
+
+  ada->buttons_raw = buttons_now;
+
+  for (int i = 0; i < 5; ++i) {
+    struct button_timing *bt = &ada->button_timing[i];
+
+    if (!((ada->buttons_before ^ buttons_now) & PIN(i))) continue;
+
+    if (bt->changed_ns && (s64)(time_ns - bt->changed_ns) < (s64)debounce_ns) {
+      ++ada->stats.button_bounces;
+      continue;
+    }
+
+    bt->changed_ns = time_ns;
+    changed |= PIN(i);
+  }
+
+  return changed;
+}
+
+static void buttons_press_release(struct ada *ada, int changed, u64 time_ns)
+{
+  int held = ~ada->buttons_before & BUTTON_PINS;
+  unsigned int rate = ACCESS_ONCE(repeat_rate);
+
+  for (int i = 0; i < 5; ++i) {
+    struct button_timing *bt = &ada->button_timing[i];
+
+    if (!(changed & PIN(i))) continue;
+
+    bt->long_ns = 0;
+    bt->repeat_ns = 0;
+
+    if (!(held & PIN(i))) {
+      button_event(ada, time_ns, i, ADA_BUTTON_RELEASE, held);
+      continue;
+    }
+
+    button_event(ada, time_ns, i, ADA_BUTTON_PRESS, held);
+    if (long_press_ms) {
+      bt->long_ns = time_ns + (u64)long_press_ms * NSEC_PER_MSEC;
+    }
+    if (repeat_delay_ms && rate) {
+      bt->repeat_ns = time_ns + (u64)repeat_delay_ms * NSEC_PER_MSEC;
+    }
+  }
+
+  if (!(changed & held) || hweight8(held) < 2) return;
+
+  // A chord, none of its buttons long presses or repeats
+  button_event(ada, time_ns, __ffs(changed & held), ADA_BUTTON_CHORD, held);
+  for (int i = 0; i < 5; ++i) {
+    ada->button_timing[i].long_ns = 0;
+    ada->button_timing[i].repeat_ns = 0;
+  }
+
+  if (held == CHORD_SCREEN_NEXT) {
+    lcd_show_step(ada, 1);
+  } else if (held == CHORD_SCREEN_PREV) {
+    lcd_show_step(ada, -1);
+  }
+}
+
+// Long presses and repeats due by now, returns whether any was sent.
+// A late repeat is sent once, missed ones are not caught up on.
+static bool buttons_timed(struct ada *ada, u64 now)
+{
+  int held = ~ada->buttons_before & BUTTON_PINS;
+  unsigned int rate = ACCESS_ONCE(repeat_rate);
+  bool sent = false;
+
+  for (int i = 0; i < 5; ++i) {
+    struct button_timing *bt = &ada->button_timing[i];
+
+    if (button_due(bt->long_ns, now)) {
+      button_event(ada, now, i, ADA_BUTTON_LONG, held);
+      bt->long_ns = 0;
+      sent = true;
+    }
+
+    if (button_due(bt->repeat_ns, now)) {
+      button_event(ada, now, i, ADA_BUTTON_REPEAT, held);
+      sent = true;
+
+      if (!rate) {
+	bt->repeat_ns = 0;
+	continue;
+      }
+      bt->repeat_ns += div_u64(NSEC_PER_SEC, rate);
+      if (button_due(bt->repeat_ns, now)) {
+	bt->repeat_ns = now + div_u64(NSEC_PER_SEC, rate);
+      }
+    }
+  }
+
+  return sent;
+}
+
+// Jiffies until the engine is due again: a bounce to look at, a
+// long press or a repeat. 0 for nothing to do.
+static unsigned long buttons_next(struct ada *ada, u64 now)
+{
+  u64 debounce_ns = (u64)ACCESS_ONCE(debounce_ms) * NSEC_PER_MSEC;
+  u64 next = 0;
+
+  for (int i = 0; i < 5; ++i) {
+    struct button_timing *bt = &ada->button_timing[i];
+
+    if ((ada->buttons_raw ^ ada->buttons_before) & PIN(i)) {
+      next = button_sooner(next, bt->changed_ns + debounce_ns);
+    }
+    next = button_sooner(next, bt->long_ns);
+    next = button_sooner(next, bt->repeat_ns);
+  }
+
+  if (!next) return 0;
+  if (button_due(next, now)) return 1;
+  return msecs_to_jiffies(div_u64(next - now, NSEC_PER_MSEC)) + 1;
+}
+
+// The button engine. Buttons pull their pin low when pressed,
+// buttons_now are the pins read at time_ns. Returns jiffies until
+// it wants to run again, see buttons_next().
+static unsigned long buttons_update(struct ada *ada, int buttons_now, u64 time_ns)
+{
+  mutex_lock(&ada->button_lock);
+
+  int changed = buttons_debounce(ada, buttons_now, time_ns);
+  ada->buttons_before ^= changed;
+  buttons_press_release(ada, changed, time_ns);
+
+  u64 now = ktime_to_ns(ktime_get());
+  bool sent = buttons_timed(ada, now) || changed;
+
+  if (sent) {
+    if (ada->button_input) {
+      input_sync(ada->button_input);
+    }
+    wake_up_interruptible(&ada->but_readq);
+    kill_fasync(&ada->but_fasync_queue, SIGIO, POLL_IN);
+  }
+
+  unsigned long next = buttons_next(ada, now);
+
+  mutex_unlock(&ada->button_lock);
+
+  return next;
+}
+
+// All five buttons in one read, sampled at the same instant
+static unsigned long scan_buttons(struct ada *ada)
+{
+  u64 now = ktime_to_ns(ktime_get());
+  stat_count(&ada->stats, &ada->stats.scans);
+  int pins = port_read(ada, PATH_SCAN, MCP_GPIOA);
+  if (pins < 0) return 0;
+
+  return buttons_update(ada, pins & BUTTON_PINS, now);
+}
+
+// Interrupt driven input. The expander's INT output (port A,
+// active low) is wired to a host interrupt, the irq of the I2C
+// device. No interrupt or failing to get it means polling.
+
+// Only timestamp here, the expander can't be read in hard IRQ
+static irqreturn_t button_irq_handler(int irq, void *data)
+{
+  struct ada *ada = data;
+
+  ada->button_irq_time = ktime_to_ns(ktime_get());
+  return IRQ_WAKE_THREAD;
+}
+
+// INTCAP holds the pins as they were when the interrupt fired,
+// GPIO as they are now, reading either clears the interrupt.
+// Looking at both catches a press already released by now. Bounces
+// and timed events are left to the scanner, queued for when the
+// engine is due.
+static irqreturn_t button_irq_thread(int irq, void *data)
+{
+  struct ada *ada = data;
+
+  bus_begin(ada, BUS_SCAN);
+  int intcap = port_read(ada, PATH_SCAN, MCP_INTCAPA);
+  int now = port_read(ada, PATH_SCAN, MCP_GPIOA);
+  bus_end(ada, BUS_SCAN);
+
+  if (intcap < 0 || now < 0) return IRQ_NONE;
+
+  buttons_update(ada, intcap & BUTTON_PINS, ada->button_irq_time);
+  unsigned long next = buttons_update(ada, now & BUTTON_PINS, ktime_to_ns(ktime_get()));
+  if (next) {
+    mod_delayed_work(ada->scanner_q, &ada->scanner_w, next);
+  }
+
+  return IRQ_HANDLED;
+}
+
+static int button_irq_init(struct ada *ada)
+{
+  int err = 0;
+
+  if (!ada->port_ready) return -ENODEV;
+
+  int irq = ada->client->irq;
+
+  // Interrupt on any change of the button pins
+  err = ada->backend->write_byte(ada, MCP_INTCONA, 0x00);
+  if (err) return err;
+  err = ada->backend->write_byte(ada, MCP_GPINTENA, BUTTON_PINS);
+  if (err) return err;
+
+  // Start from the current state, this also clears the interrupt
+  int now = port_read(ada, PATH_SCAN, MCP_GPIOA);
+  if (now < 0) {
+    err = now;
+    goto int_fail;
+  }
+  ada->buttons_before = now & BUTTON_PINS;
+  ada->buttons_raw = ada->buttons_before;
+
+  // INT stays low until the thread has read the port
+  err = request_threaded_irq(irq, button_irq_handler, button_irq_thread,
+			     IRQF_TRIGGER_LOW | IRQF_ONESHOT,
+			     dev_name(&ada->client->dev), ada);
+  if (err) goto int_fail;
+
+  ada->button_irq = irq;
+
+  return 0;
+
+ int_fail:
+  ada->backend->write_byte(ada, MCP_GPINTENA, 0x00);
+
+  return err;
+}
+
+static void button_irq_exit(struct ada *ada)
+{
+  free_irq(ada->button_irq, ada);
+  ada->backend->write_byte(ada, MCP_GPINTENA, 0x00);
+  ada->button_irq = -1;
+}
+
+// Scanning work queue. Timer won't work since GPIO calls
+// may block which is not allowed in timer's interrupt
+// context!
+
+// Scanning frequency in Hz
+#define SCAN_FRQ 50
+
+// Polling scans at SCAN_FRQ or sooner when the engine is due, with
+// an interrupt the scanner only runs for the engine
+static void scanner_work(struct work_struct *work)
+{
+  struct ada *ada = container_of(to_delayed_work(work), struct ada, scanner_w);
+
+  unsigned long next = scan_buttons(ada);
+  if (ada->button_irq < 0 && (!next || next > HZ/SCAN_FRQ)) {
+    next = HZ/SCAN_FRQ;
+  }
+  if (!next) return;
+
+  PREPARE_DELAYED_WORK(&ada->scanner_w, scanner_work);
+  queue_delayed_work(ada->scanner_q, &ada->scanner_w, next);
+}
+
+static int scanner_init(struct ada *ada)
+{
+  ada->buttons_before = BUTTON_PINS;
+  ada->buttons_raw = BUTTON_PINS;
+  memset(ada->button_timing, 0, sizeof(ada->button_timing));
+  ada->button_head = 0;
+  ada->button_tail = 0;
+  ada->button_irq = -1;
+
+  ada->scanner_q = alloc_workqueue(MODULE_NAME "%d_q", WQ_UNBOUND, 1, ada->index);
+  if (!ada->scanner_q) return -ENOMEM;
+  INIT_DELAYED_WORK(&ada->scanner_w, scanner_work);
+
+  // The mock has no interrupt line
+  if (ada->client && ada->client->irq > 0) {
+    int err = button_irq_init(ada);
+    if (!err) return 0;
+    printk(KERN_ALERT MODULE_NAME "%d: no button interrupt (%d), polling\n",
+	   ada->index, err);
+  }
+
+  queue_delayed_work(ada->scanner_q, &ada->scanner_w, HZ/SCAN_FRQ);
+
+  return 0;
+}
+
+static void scanner_exit(struct ada *ada)
+{
+  if (ada->button_irq >= 0) {
+    button_irq_exit(ada);
+  }
+  cancel_delayed_work_sync(&ada->scanner_w);
+  flush_workqueue(ada->scanner_q);
+  destroy_workqueue(ada->scanner_q);
+}
+
+/************************************************************
+ * Button file ops
+ */
+
+typedef struct {
+  struct ada *ada;
+  bool binary;
+  bool eof;
+} but_file_state_t;
+
+// Minors of /dev/adabutN come after those of /dev/adalcdN
+static int but_open(struct inode *inode, struct file *filp)
+{
+  struct ada *ada = ada_get(iminor(inode) - ADA_PANELS_MAX);
+  if (!ada) return -ENODEV;
+
+  but_file_state_t *fs = kmalloc(sizeof(but_file_state_t), GFP_KERNEL);
+  if (!fs) {
+    ada_put(ada);
+    return -ENOMEM;
+  }
+
+  filp->private_data = fs;
+
+  fs->ada = ada;
+  fs->binary = false;
+  fs->eof = false;
+
+  // Events nobody was there to read
+  mutex_lock(&ada->but_read_lock);
+  if (ada->but_readers++ == 0) {
+    ACCESS_ONCE(ada->button_tail) = ACCESS_ONCE(ada->button_head);
+  }
+  mutex_unlock(&ada->but_read_lock);
+
+  return 0;
+}
+
+// Take up to max events from the ring into user buffer
+static int but_copy_events(struct ada *ada, struct ada_button_event __user *ubuff, unsigned int max)
+{
+  unsigned int tail = ada->button_tail;
+  unsigned int n = ACCESS_ONCE(ada->button_head) - tail;
+  // Events must be read after the head
+  smp_rmb();
+
+  if (n > max) {
+    n = max;
+  }
+
+  unsigned int first = BUTTON_RING_SIZE - tail % BUTTON_RING_SIZE;
+  if (first > n) {
+    first = n;
+  }
+
+  if (copy_to_user(ubuff, &ada->button_ring[tail % BUTTON_RING_SIZE],
+		   first * sizeof(*ubuff)) ||
+      copy_to_user(ubuff + first, &ada->button_ring[0],
+		   (n - first) * sizeof(*ubuff))) {
+    return -EFAULT;
+  }
+
+  u64 now = ktime_to_ns(ktime_get());
+  for (unsigned int i = 0; i < n; ++i) {
+    struct ada_button_event *ev = &ada->button_ring[(tail + i) % BUTTON_RING_SIZE];
+    if (ev->type == ADA_BUTTON_PRESS) {
+      stat_hist_add(&ada->stats, &ada->stats.press_hist, now - ev->time_ns);
+    }
+  }
+
+  // Events must be read before the producer may reuse the slots
+  smp_mb();
+  ACCESS_ONCE(ada->button_tail) = tail + n;
+
+  return n;
+}
+
+// Presses and repeats are digits of the text format
+static bool button_event_text(const struct ada_button_event *ev)
+{
+  return ev->type == ADA_BUTTON_PRESS || ev->type == ADA_BUTTON_REPEAT;
+}
+
+// Text format: one digit per button press or repeat, other events
+// are skipped
+static int but_copy_presses(struct ada *ada, char __user *ubuff, size_t len)
+{
+  unsigned int tail = ada->button_tail;
+  unsigned int head = ACCESS_ONCE(ada->button_head);
+  smp_rmb();
+
+  u64 now = ktime_to_ns(ktime_get());
+  int n = 0;
+  while (tail != head && n < len) {
+    struct ada_button_event *ev = &ada->button_ring[tail % BUTTON_RING_SIZE];
+    if (button_event_text(ev)) {
+      if (put_user('0' + ev->button, ubuff + n)) return -EFAULT;
+      if (ev->type == ADA_BUTTON_PRESS) {
+	stat_hist_add(&ada->stats, &ada->stats.press_hist, now - ev->time_ns);
+      }
+      ++n;
+    }
+    ++tail;
+  }
+
+  smp_mb();
+  ACCESS_ONCE(ada->button_tail) = tail;
+
+  return n;
+}
+
+// Is there something for this reader: any event in binary mode,
+// a press or repeat in text mode
+static bool but_pending(but_file_state_t *fs)
+{
+  struct ada *ada = fs->ada;
+  unsigned int tail = ACCESS_ONCE(ada->button_tail);
+  unsigned int head = ACCESS_ONCE(ada->button_head);
+  smp_rmb();
+
+  if (fs->binary) {
+    return head != tail;
+  }
+
+  for (; tail != head; ++tail) {
+    if (button_event_text(&ada->button_ring[tail % BUTTON_RING_SIZE])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static ssize_t but_read(
+    struct file *filp, char __user *ubuff, size_t len, loff_t *offs)
+{
+  but_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+  int ret = 0;
+
+  // Text reads return the pending presses followed by EOF
+  if (fs->eof) {
+    fs->eof = false;
+    return 0;
+  }
+
+  if (fs->binary && len < sizeof(struct ada_button_event)) {
+    return -EINVAL;
+  }
+
+  // Nothing would be consumed, waiting for a press would spin
+  if (len == 0) return 0;
+
+  while (ret == 0) {
+    if (filp->f_flags & O_NONBLOCK) {
+      if (!but_pending(fs)) {
+	return ACCESS_ONCE(ada->gone) ? -ENODEV : -EAGAIN;
+      }
+    } else {
+      ret = wait_event_interruptible_exclusive(ada->but_readq,
+					       but_pending(fs) || ACCESS_ONCE(ada->gone));
+
+      // Wake up from interrupts, try again
+      if (ret) return -ERESTARTSYS;
+      if (!but_pending(fs)) return -ENODEV;
+    }
+
+    mutex_lock(&ada->but_read_lock);
+    if (fs->binary) {
+      ret = but_copy_events(ada, (struct ada_button_event __user *)ubuff,
+			    len / sizeof(struct ada_button_event));
+      if (ret > 0) {
+	ret *= sizeof(struct ada_button_event);
+      }
+    } else {
+      ret = but_copy_presses(ada, ubuff, len);
+    }
+    mutex_unlock(&ada->but_read_lock);
+
+    // Another reader took what was pending. Only a blocking read
+    // goes back to waiting, but_pending() is false by now.
+    if (ret == 0 && (filp->f_flags & O_NONBLOCK)) return -EAGAIN;
+  }
+
+  if (ret > 0 && !fs->binary) {
+    fs->eof = true;
+  }
+
+  return ret;
+}
+
+static long but_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  but_file_state_t *fs = filp->private_data;
+  int binary;
+
+  switch (cmd) {
+  case ADA_IOC_BUT_BINARY:
+    if (get_user(binary, (int __user *)arg)) return -EFAULT;
+    fs->binary = binary;
+    fs->eof = false;
+    return 0;
+  default:
+    return -ENOTTY;
+  }
+}
+
+static unsigned int but_poll(struct file *filp, poll_table *wait)
+{
+  but_file_state_t *fs = filp->private_data;
+
+  poll_wait(filp, &fs->ada->but_readq, wait);
+
+  if (fs->eof || but_pending(fs)) {
+    return POLLIN | POLLRDNORM;
+  }
+  if (ACCESS_ONCE(fs->ada->gone)) {
+    return POLLERR | POLLHUP;
+  }
+  return 0;
+}
+
+static int but_fasync(int fd, struct file *filp, int on)
+{
+  but_file_state_t *fs = filp->private_data;
+
+  return fasync_helper(fd, filp, on, &fs->ada->but_fasync_queue);
+}
+
+static ssize_t but_write(struct file *filp, const char __user *ubuff, size_t len, loff_t *offs)
+{
+  return -EPERM;
+}
+
+static int but_release(struct inode *inode, struct file *filp)
+{
+  but_file_state_t *fs = filp->private_data;
+
+  but_fasync(-1, filp, 0);
+
+  mutex_lock(&fs->ada->but_read_lock);
+  --fs->ada->but_readers;
+  mutex_unlock(&fs->ada->but_read_lock);
+
+  ada_put(fs->ada);
+  kfree(fs);
+  return 0;
+}
+
+static struct file_operations but_fileops = {
+  .owner = THIS_MODULE,
+  .open = but_open,
+  .read = but_read,
+  .write = but_write,
+  .poll = but_poll,
+  .fasync = but_fasync,
+  .unlocked_ioctl = but_ioctl,
+  .release = but_release
+};
+
+/************************************************************
+ * LCD buffer
+ */
+
+static int screens = 4;
+
+module_param(screens, int, 0444);
+
+// A page of its own per panel so that it can be mapped to user
+// space. The cells of screen n start at n * LCD_BUFFER_LENGTH.
+
+static const char lcd_test_pattern[LCD_BUFFER_LENGTH] =
+"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ9876543210zyxwvuts";
+
+static int lcd_buffer_init(struct ada *ada)
+{
+  BUILD_BUG_ON((LCD_OVERLAY + 1) * LCD_BUFFER_LENGTH > PAGE_SIZE);
+
+  ada->lcd_buffer = (char *)get_zeroed_page(GFP_KERNEL);
+  if (!ada->lcd_buffer) return -ENOMEM;
+
+  memset(ada->lcd_buffer, ' ', (LCD_OVERLAY + 1) * LCD_BUFFER_LENGTH);
+  memcpy(ada->lcd_buffer, lcd_test_pattern, LCD_BUFFER_LENGTH);
+
+  return 0;
+}
+
+static void lcd_buffer_exit(struct ada *ada)
+{
+  free_page((unsigned long)ada->lcd_buffer);
+  ada->lcd_buffer = NULL;
+}
+
+// Geometry of new panels, setting it sets that of every panel
+static struct lcd_size lcd_size = { 16, 2 };
+
+// A line of DDRAM holds 40 characters whatever the display shows
+#define LCD_DDRAM_LINE 40
+
+// Lines with a marquee, bit per line. Only on 1- and 2-line
+// displays, where every line has a DDRAM line of its own. Such a
+// line is 40 cells wide and the display shift scrolls it through
+// the characters of the panel. Of new panels, as lcd_size.
+static unsigned int marquee;
+
+static unsigned int lcd_marquee_lines(unsigned int mask, const struct lcd_size *size)
+{
+  return size->lines <= 2 ? mask & ((1 << size->lines) - 1) : 0;
+}
+
+// Cells a line holds, with lcd_lock held
+static int lcd_line_width(struct ada *ada, int line)
+{
+  if (lcd_marquee_lines(ada->marquee, &ada->lcd_size) & (1 << line)) {
+    return LCD_DDRAM_LINE;
+  }
+  return ada->lcd_size.characters;
+}
+
+static char *lcd_screen(struct ada *ada, int screen)
+{
+  return ada->lcd_buffer + screen * LCD_BUFFER_LENGTH;
+}
+
+// Writers change the cells of their screen under lcd_lock and
+// bump its lcd_screen_gen. Only changes of the visible screen
+// are marked in lcd_dirty and bump lcd_gen, the others never
+// reach the panel until their screen is shown.
+
+// Screen on the panel, lcd_active unless the overlay covers it.
+// With lcd_lock held.
+static int lcd_visible(struct ada *ada)
+{
+  return ada->lcd_overlay_on ? LCD_OVERLAY : ada->lcd_active;
+}
+
+// Note a change of cells of a screen, with lcd_lock held
+static void lcd_mark_dirty(struct ada *ada, int screen, int from, int n)
+{
+  if (screen == lcd_visible(ada)) {
+    bitmap_set(ada->lcd_dirty, from, n);
+  }
+}
+
+// lcd_frame is the frame being sent to the panel, a snapshot of
+// the visible screen taken by the flush worker, and lcd_shadow
+// what the panel currently shows, both indexed like the cells of a
+// screen. Only cells marked dirty and different from the shadow
+// are sent. Owned by the flush worker.
+// The shadow follows DDRAM: when the display is shifted, cell c of
+// a line without marquee is at (c + lcd_shift) % 40 of its line.
+// With lcd_shadow_wide it also holds the DDRAM off the panel.
+
+static int output_display(const struct lcd_size *size, char *output_buffer, const char *display_buffer)
+{
+  switch (size->lines) {
+  case 1:
+    memcpy(output_buffer, display_buffer, size->characters);
+    output_buffer[size->characters] = '\n';
+    return size->characters+1;
+    break;
+  case 2:
+    memcpy(output_buffer, display_buffer, size->characters);
+    output_buffer[size->characters] = '\n';
+    memcpy(output_buffer+size->characters+1, display_buffer+40, size->characters);
+    output_buffer[2 * size->characters + 1] = '\n';
+    return 2 * size->characters + 2;
+    break;
+  case 4:
+    memcpy(output_buffer, display_buffer, size->characters);
+    output_buffer[size->characters] = '\n';
+    memcpy(output_buffer+size->characters+1, display_buffer+20, size->characters);
+    output_buffer[2 * size->characters + 1] = '\n';
+    memcpy(output_buffer+2*size->characters+2, display_buffer+40, size->characters);
+    output_buffer[3 * size->characters + 2] = '\n';
+    memcpy(output_buffer+3*size->characters+3, display_buffer+60, size->characters);
+    output_buffer[4 * size->characters + 3] = '\n';
+    return 4 * size->characters + 4;
+    break;
+  default:
+    break;
+  }
+  return 0;
+}
+
+static void lcd_schedule_flush(struct ada *ada);
+
+static int size_set(const char *val, const struct kernel_param *kp)
+{
+  int characters = 0;
+  int lines = 0;
+
+  int n_read = sscanf(val, "%dx%d", &characters, &lines);
+  if (n_read != 2) return -EINVAL;
+
+  if (lines != 1 && lines != 2 && lines != 4) return -EINVAL;
+  if (characters <= 0 || characters > 80) return -EINVAL;
+  if (lines*characters > 80) return -EINVAL;
+
+  mutex_lock(&ada_panels_lock);
+
+  struct lcd_size *ls = kp->arg;
+  ls->characters = characters;
+  ls->lines = lines;
+
+  for (int i = 0; i < ADA_PANELS_MAX; ++i) {
+    struct ada *ada = ada_panels[i];
+    if (!ada) continue;
+
+    mutex_lock(&ada->lcd_lock);
+    ada->lcd_size = *ls;
+
+    // Cells move on the panel, rewrite all on next flush
+    ada->lcd_resync = true;
+    bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+    ++ada->lcd_gen;
+    mutex_unlock(&ada->lcd_lock);
+
+    lcd_schedule_flush(ada);
+  }
+
+  mutex_unlock(&ada_panels_lock);
+
+  return 0;
+}
+
+static int size_get(char *val, const struct kernel_param *kp)
+{
+  struct lcd_size *ls = kp->arg;
+  return sprintf(val, "%dx%d", ls->characters, ls->lines);
+}
+
+static int display_set(const char *val, const struct kernel_param *kp)
+{
+  // Do nothing!
+  return -EPERM;
+}
+
+// The first panel, /dev/adalcdN reads any
+static int display_get(char *val, const struct kernel_param *kp)
+{
+  struct ada *ada = ada_get_first();
+  if (!ada) return -ENODEV;
+
+  mutex_lock(&ada->lcd_lock);
+  int ret = output_display(&ada->lcd_size, val, lcd_screen(ada, lcd_visible(ada)));
+  mutex_unlock(&ada->lcd_lock);
+
+  ada_put(ada);
+  return ret;
+}
+
+static struct kernel_param_ops size_ops = {
+  .set = size_set,
+  .get = size_get
+};
+
+static struct kernel_param_ops display_ops = {
+  .set = display_set,
+  .get = display_get
+};
+
+module_param_cb(lcd_size, &size_ops, &lcd_size, 0644);
+module_param_cb(display, &display_ops, NULL, 0644);
+
+/************************************************************
+ * Custom glyphs
+ */
+
+// The eight CGRAM characters cache glyphs by their bitmap: row r
+// in bits 8r...8r+4. A cell shows a glyph by holding its slot,
+// 0...7. Slots no screen shows are reused, least recently used
+// first, and the flusher uploads the ones marked in
+// lcd_glyph_dirty. Everything with lcd_lock held.
+
+// Slots held by cells of some screen, codes 8...15 show the same
+// characters as 0...7
+static unsigned long lcd_glyphs_shown(struct ada *ada)
+{
+  unsigned long shown = 0;
+  const char *cells = ada->lcd_buffer;
+
+  for (int i = 0; i < (LCD_OVERLAY + 1) * LCD_BUFFER_LENGTH; ++i) {
+    if ((u8)cells[i] < 2 * LCD_GLYPH_SLOTS) {
+      shown |= 1 << (cells[i] % LCD_GLYPH_SLOTS);
+    }
+  }
+  return shown;
+}
+
+// Slot holding bitmap, loading it if needed, or -ENOSPC when all
+// slots are shown
+static int lcd_glyph_get(struct ada *ada, u64 bitmap)
+{
+  int slot = -1;
+
+  ++ada->lcd_glyph_clock;
+
+  for (int i = 0; i < LCD_GLYPH_SLOTS; ++i) {
+    if (ada->lcd_glyphs[i].valid && ada->lcd_glyphs[i].bitmap == bitmap) {
+      ada->lcd_glyphs[i].used = ada->lcd_glyph_clock;
+      ++ada->stats.glyph_hits;
+      return i;
+    }
+  }
+
+  unsigned long shown = lcd_glyphs_shown(ada);
+
+  for (int i = 0; i < LCD_GLYPH_SLOTS; ++i) {
+    if (shown & (1 << i)) continue;
+    if (!ada->lcd_glyphs[i].valid) {
+      slot = i;
+      break;
+    }
+    if (slot < 0 || ada->lcd_glyphs[i].used < ada->lcd_glyphs[slot].used) {
+      slot = i;
+    }
+  }
+  if (slot < 0) return -ENOSPC;
+
+  ada->lcd_glyphs[slot].bitmap = bitmap;
+  ada->lcd_glyphs[slot].used = ada->lcd_glyph_clock;
+  ada->lcd_glyphs[slot].valid = true;
+  ada->lcd_glyph_dirty |= 1 << slot;
+
+  return slot;
+}
+
+/************************************************************
+ * HD44780U (KS0066U) driver
+ */
+
+// LCD pins
+#define LCD_RS 15
+#define LCD_RW 14
+#define LCD_E  13
+#define LCD_D4 12
+#define LCD_D5 11
+#define LCD_D6 10
+#define LCD_D7  9
+
+#define LCD_DATA (PIN(LCD_D4) | PIN(LCD_D5) | PIN(LCD_D6) | PIN(LCD_D7))
+#define LCD_PINS (LCD_DATA | PIN(LCD_E) | PIN(LCD_RW) | PIN(LCD_RS))
+
+static u16 lcd_nybble_pins(int n)
+{
+  return
+    ((n>>0) & 1) << LCD_D4 |
+    ((n>>1) & 1) << LCD_D5 |
+    ((n>>2) & 1) << LCD_D6 |
+    ((n>>3) & 1) << LCD_D7;
+}
+
+static int lcd_pins_nybble(u16 pins)
+{
+  return
+    ((pins>>LCD_D4) & 1) << 0 |
+    ((pins>>LCD_D5) & 1) << 1 |
+    ((pins>>LCD_D6) & 1) << 2 |
+    ((pins>>LCD_D7) & 1) << 3;
+}
+
+// RS and the data go out with E rising, the controller latches
+// them when E falls in the second write. A scan in between would
+// only stretch the pulse, so the bus is held.
+static int lcd_write_nybble(struct ada *ada, u16 rs, int n)
+{
+  int path = rs ? PATH_LCD_DATA : PATH_LCD_CMD;
+
+  bus_begin(ada, BUS_LCD);
+  int err = port_write(ada, path, PIN(LCD_RS) | LCD_DATA | PIN(LCD_E),
+		       rs | lcd_nybble_pins(n) | PIN(LCD_E));
+  // E goes low anyway
+  int fall = port_write(ada, path, PIN(LCD_E), 0);
+  bus_end(ada, BUS_LCD);
+
+  return err ? err : fall;
+}
+
+// Between bytes the controller doesn't mind a pause, a scan
+// waiting for a longer group goes there
+static int lcd_write_byte(struct ada *ada, u16 rs, int b)
+{
+  bus_yield(ada);
+
+  bus_begin(ada, BUS_LCD);
+  int err = lcd_write_nybble(ada, rs, b>>4);
+  if (!err) {
+    err = lcd_write_nybble(ada, rs, b>>0);
+  }
+  bus_end(ada, BUS_LCD);
+
+  return err;
+}
+
+static int lcd_write_data(struct ada *ada, int b)
+{
+  return lcd_write_byte(ada, PIN(LCD_RS), b);
+}
+
+static int lcd_write_cmd(struct ada *ada, int b)
+{
+  return lcd_write_byte(ada, 0, b);
+}
+
+// Burst encoding: the four port B values that clock byte b into
+// the controller with RS low (hi nybble with E high, E low, lo
+// nybble with E high, E low). Precomputed once so encoding a line
+// is just table lookups.
+
+#define LCD_PORTB ((LCD_DATA | PIN(LCD_E) | PIN(LCD_RS)) >> 8)
+#define LCD_RS_B  (PIN(LCD_RS) >> 8)
+
+static u8 lcd_burst_table[256][4];
+
+static void lcd_burst_table_init(void)
+{
+  for (int b = 0; b < 256; ++b) {
+    u8 hi = lcd_nybble_pins(b>>4) >> 8;
+    u8 lo = lcd_nybble_pins(b>>0) >> 8;
+    lcd_burst_table[b][0] = hi | (PIN(LCD_E) >> 8);
+    lcd_burst_table[b][1] = hi;
+    lcd_burst_table[b][2] = lo | (PIN(LCD_E) >> 8);
+    lcd_burst_table[b][3] = lo;
+  }
+}
+
+static u8 *lcd_burst_encode(u8 *values, u8 rs, u8 b)
+{
+  for (int i = 0; i < 4; ++i) {
+    *values++ = lcd_burst_table[b][i] | rs;
+  }
+  return values;
+}
+
+static const int line_starts[] = {0, 64, 20, 84};
+
+// With busy_flag the controller is asked when it is done with a
+// clear or home instead of waiting the worst case 1.52 ms. Each
+// poll takes eight transfers, so this only pays off on a bus
+// faster than the 100 kHz default. Every other command finishes
+// before the next transfer could start anyway.
+static bool busy_flag;
+
+module_param(busy_flag, bool, 0444);
+
+// Read n bytes with RW high: the busy flag and address counter
+// with RS low, data from the address counter on with RS high. The
+// controller drives the data pins while E is high, high nybble
+// first.
+static int lcd_read_bytes(struct ada *ada, u16 rs, u8 *buf, int n)
+{
+  int path = rs ? PATH_LCD_DATA : PATH_LCD_CMD;
+
+  // One group, the data pins are inputs until the end
+  bus_begin(ada, BUS_LCD);
+
+  int err = port_input_b(ada, path, LCD_DATA >> 8, true);
+  if (err) {
+    bus_end(ada, BUS_LCD);
+    return err;
+  }
+
+  for (int i = 0; i < 2 * n && !err; ++i) {
+    port_write(ada, path, PIN(LCD_RS) | PIN(LCD_RW) | PIN(LCD_E),
+	       rs | PIN(LCD_RW) | PIN(LCD_E));
+    int pins = port_read(ada, path, MCP_GPIOB);
+    port_write(ada, path, PIN(LCD_E), 0);
+
+    if (pins < 0) {
+      err = pins;
+    } else if (i & 1) {
+      buf[i / 2] |= lcd_pins_nybble(pins << 8);
+    } else {
+      buf[i / 2] = lcd_pins_nybble(pins << 8) << 4;
+    }
+  }
+
+  port_write(ada, path, PIN(LCD_RW), 0);
+  int restore = port_input_b(ada, path, LCD_DATA >> 8, false);
+  bus_end(ada, BUS_LCD);
+
+  return err ? err : restore;
+}
+
+// 1 while the controller is busy
+static int lcd_read_busy(struct ada *ada)
+{
+  u8 b;
+  int err = lcd_read_bytes(ada, 0, &b, 1);
+  if (err) return err;
+
+  ++ada->stats.busy_polls;
+  return !!(b & 0x80);
+}
+
+// Wait for a command that takes up to ms to finish
+static void lcd_wait(struct ada *ada, unsigned int ms)
+{
+  if (busy_flag) {
+    unsigned long timeout = jiffies + msecs_to_jiffies(ms) + 1;
+    int busy;
+
+    while ((busy = lcd_read_busy(ada)) > 0 && time_before(jiffies, timeout)) {
+    }
+    if (busy == 0) return;
+  }
+
+  // Not asked, no answer or it took too long
+  port_delay(ada, ms);
+}
+
+// Take over the panel as the last module left it instead of
+// resetting and clearing it: no blank, and the content is back on
+// screen 0 at once. Only the cells the geometry shows are read.
+static bool warm;
+
+module_param(warm, bool, 0444);
+
+static int lcd_warm_init(struct ada *ada)
+{
+  // Only a controller in 4 bit mode and in step with the nybbles
+  // reads back the address just set
+  u8 ac;
+  lcd_write_cmd(ada, 0x80 + 0x27);
+  int err = lcd_read_bytes(ada, 0, &ac, 1);
+  if (err) return err;
+  if ((ac & 0x7F) != 0x27) return -EIO;
+
+  lcd_write_cmd(ada, 0x28); // 2 lines 5x8 font
+  lcd_write_cmd(ada, 0x0C); // Display on
+  lcd_write_cmd(ada, 0x06); // Cursor moves right
+  lcd_write_cmd(ada, 0x02); // Home, undo a marquee shift
+  lcd_wait(ada, 2);
+
+  mutex_lock(&ada->lcd_lock);
+  struct lcd_size size = ada->lcd_size;
+  mutex_unlock(&ada->lcd_lock);
+
+  int line_offset = size.lines == 2 ? 40 : 20;
+  char panel[LCD_BUFFER_LENGTH];
+
+  memset(panel, ' ', LCD_BUFFER_LENGTH);
+  for (int line = 0; line < size.lines && !err; ++line) {
+    lcd_write_cmd(ada, 0x80 + line_starts[line]);
+    err = lcd_read_bytes(ada, PIN(LCD_RS), panel + line * line_offset,
+			 size.characters);
+  }
+  if (err) return err;
+
+  mutex_lock(&ada->lcd_lock);
+  char *cells = lcd_screen(ada, 0);
+  for (int line = 0; line < size.lines; ++line) {
+    memcpy(cells + line * line_offset, panel + line * line_offset,
+	   size.characters);
+  }
+  ++ada->lcd_screen_gen[0];
+
+  // Cells off the panel are unknown, see flusher_work()
+  memcpy(ada->lcd_shadow, panel, LCD_BUFFER_LENGTH);
+  ada->lcd_shadow_valid = true;
+  ada->lcd_shadow_wide = false;
+  ada->lcd_shift = 0;
+  bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+  mutex_unlock(&ada->lcd_lock);
+
+  return 0;
+}
+
+// Sleeps, run from the flush work queue, see lcd_init_work()
+static void lcd_init(struct ada *ada)
+{
+  if (warm) {
+    int err = lcd_warm_init(ada);
+    if (!err) return;
+    printk(KERN_ALERT MODULE_NAME "%d: no warm start (%d), resetting panel\n",
+	   ada->index, err);
+  }
+
+  lcd_write_nybble(ada, 0, 3);
+  port_delay(ada, 5);
+  lcd_write_nybble(ada, 0, 3);
+  port_delay(ada, 1);
+  lcd_write_nybble(ada, 0, 3);
+  lcd_write_nybble(ada, 0, 2);
+
+  // 4 bit mode now, the busy flag can be read from here on
+  lcd_write_cmd(ada, 0x28); // 2 lines 5x8 font
+  lcd_write_cmd(ada, 0x0C); // Display on
+  lcd_write_cmd(ada, 0x06); // Cursor moves right
+  lcd_write_cmd(ada, 0x01); // Clear
+  lcd_wait(ada, 2);
+
+  // Panel is blank now, buffer content is shown on first flush
+  mutex_lock(&ada->lcd_lock);
+  memset(ada->lcd_shadow, ' ', LCD_BUFFER_LENGTH);
+  ada->lcd_shadow_valid = true;
+  ada->lcd_shadow_wide = true;
+  ada->lcd_shift = 0;
+  bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+  mutex_unlock(&ada->lcd_lock);
+}
+
+// Changed cells closer than this are sent as one run: resending
+// the unchanged cells in between costs no more than a new address
+#define LCD_RUN_GAP 1
+
+// DDRAM column of cell col of a line. Shifting the display moves
+// the window of every line, those without marquee are written
+// where the window is now.
+static int lcd_ddram_col(struct ada *ada, int line, int col)
+{
+  if (ada->lcd_shift == 0 || (ada->lcd_frame_marquee & (1 << line))) {
+    return col;
+  }
+  return (col + ada->lcd_shift) % LCD_DDRAM_LINE;
+}
+
+static bool lcd_cell_changed(struct ada *ada, int line, int base, int col)
+{
+  return test_bit(base + col, ada->lcd_frame_dirty) &&
+    (!ada->lcd_shadow_valid ||
+     ada->lcd_shadow[base + lcd_ddram_col(ada, line, col)] != ada->lcd_frame[base + col]);
+}
+
+// Send the changed runs of a line, each preceded by a set DDRAM
+// address command. In burst mode the whole line is one transfer.
+static int lcd_update_line(struct ada *ada, int line)
+{
+  int characters = ada->lcd_frame_size.characters;
+  if (ada->lcd_frame_marquee & (1 << line)) {
+    characters = LCD_DDRAM_LINE;
+  }
+  int line_offset = 20;
+  if (ada->lcd_frame_size.lines == 2) {
+    line_offset = 40;
+  }
+  int base = line * line_offset;
+
+  u8 values[PORT_BURST_MAX];
+  u8 *v = values;
+  int sent = 0;
+  int col = 0;
+  int err = 0;
+
+  while (col < characters && !err) {
+    // Find next run
+    while (col < characters && !lcd_cell_changed(ada, line, base, col)) {
+      ++col;
+    }
+    if (col == characters) break;
+
+    // A run ends where the shifted window wraps around DDRAM
+    int start = col;
+    int end = col + 1;
+    for (col = end; col < characters && lcd_ddram_col(ada, line, col) != 0; ++col) {
+      if (lcd_cell_changed(ada, line, base, col)) {
+	end = col + 1;
+      } else if (col + 1 - end > LCD_RUN_GAP) {
+	break;
+      }
+    }
+    col = end;
+
+    int address = 0x80 + line_starts[line] + lcd_ddram_col(ada, line, start);
+    if (ada->burst) {
+      v = lcd_burst_encode(v, 0, address);
+      for (int i = start; i < end; ++i) {
+	v = lcd_burst_encode(v, LCD_RS_B, ada->lcd_frame[base + i]);
+      }
+    } else {
+      err = lcd_write_cmd(ada, address);
+      for (int i = start; i < end && !err; ++i) {
+	err = lcd_write_data(ada, ada->lcd_frame[base + i]);
+      }
+    }
+
+    // On failure the caller drops all of the shadow
+    for (int i = start; i < end; ++i) {
+      ada->lcd_shadow[base + lcd_ddram_col(ada, line, i)] = ada->lcd_frame[base + i];
+    }
+    sent += end - start;
+  }
+
+  ada->stats.cells_skipped += characters - sent;
+
+  if (err) return err;
+  return port_burst(ada, PATH_LCD_DATA, LCD_PORTB, values, v - values);
+}
+
+// Load glyphs into the CGRAM slots in mask, one transfer in
+// burst mode. Cells are always written after a set DDRAM address
+// command so the address counter can be left in CGRAM.
+static int lcd_upload_glyphs(struct ada *ada, unsigned long mask, const u64 *bitmaps)
+{
+  u8 values[LCD_GLYPH_SLOTS * 9 * 4];
+  u8 *v = values;
+  int err = 0;
+
+  bus_begin(ada, BUS_LCD);
+
+  for (int slot = 0; slot < LCD_GLYPH_SLOTS && !err; ++slot) {
+    if (!(mask & (1 << slot))) continue;
+
+    if (ada->burst) {
+      v = lcd_burst_encode(v, 0, 0x40 + 8 * slot);
+      for (int r = 0; r < 8; ++r) {
+	v = lcd_burst_encode(v, LCD_RS_B, (bitmaps[slot] >> (8 * r)) & 0x1F);
+      }
+    } else {
+      err = lcd_write_cmd(ada, 0x40 + 8 * slot);
+      for (int r = 0; r < 8 && !err; ++r) {
+	err = lcd_write_data(ada, (bitmaps[slot] >> (8 * r)) & 0x1F);
+      }
+    }
+    ++ada->stats.glyph_uploads;
+  }
+
+  if (!err) {
+    err = port_burst(ada, PATH_LCD_DATA, LCD_PORTB, values, v - values);
+  }
+  bus_end(ada, BUS_LCD);
+
+  return err;
+}
+
+// A command on its own, one transfer in burst mode
+static int lcd_send_cmd(struct ada *ada, int cmd)
+{
+  if (ada->burst) {
+    u8 values[4];
+    return port_burst(ada, PATH_LCD_CMD, LCD_PORTB, values,
+		      lcd_burst_encode(values, 0, cmd) - values);
+  }
+
+  return lcd_write_cmd(ada, cmd);
+}
+
+static int lcd_write_to_panel(struct ada *ada)
+{
+  int err = 0;
+
+  // A line is a group on the bus, scans go in between
+  for (int i = 0; i < ada->lcd_frame_size.lines; ++i) {
+    bus_begin(ada, BUS_LCD);
+    err |= lcd_update_line(ada, i);
+    bus_end(ada, BUS_LCD);
+  }
+
+  if (err) {
+    // Don't know what the panel shows in either mode, rewrite all
+    // next time
+    ada->lcd_shadow_valid = false;
+    bitmap_fill(ada->lcd_frame_dirty, LCD_BUFFER_LENGTH);
+    return -EIO;
+  }
+
+  ada->lcd_shadow_valid = true;
+  bitmap_zero(ada->lcd_frame_dirty, LCD_BUFFER_LENGTH);
+
+  return 0;
+}
+
+/************************************************************
+ * Display flush
+ */
+
+// Writes only change the cells of screens. The panel is refreshed by the
+// flush worker at most max_fps times a second (0 = no limit), and
+// it always sends the latest content: frames written in between
+// are never shown.
+
+static int max_fps = 25;
+
+module_param(max_fps, int, 0644);
+
+// lcd_gen_shown is the generation of the visible cells last sent
+// to the panel, lcd_ready tells the panel is set up, see
+// lcd_init_work(). Readers wait in lcd_changeq for the content to
+// change.
+
+static unsigned long marquee_delay(void);
+
+static void flusher_work(struct work_struct *work)
+{
+  struct ada *ada = container_of(to_delayed_work(work), struct ada, flusher_w);
+  u64 start = ktime_to_ns(ktime_get());
+
+  mutex_lock(&ada->lcd_lock);
+  if (!ada->lcd_ready) {
+    // lcd_init_work() flushes once it is done
+    mutex_unlock(&ada->lcd_lock);
+    return;
+  }
+  memcpy(ada->lcd_frame, lcd_screen(ada, lcd_visible(ada)), LCD_BUFFER_LENGTH);
+  bitmap_or(ada->lcd_frame_dirty, ada->lcd_frame_dirty, ada->lcd_dirty, LCD_BUFFER_LENGTH);
+  bitmap_zero(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+  if (ada->lcd_resync) {
+    ada->lcd_shadow_valid = false;
+    ada->lcd_resync = false;
+  }
+  ada->lcd_frame_size = ada->lcd_size;
+  unsigned int frame_marquee = lcd_marquee_lines(ada->marquee, &ada->lcd_size);
+  unsigned long gen = ada->lcd_gen;
+
+  u64 glyphs[LCD_GLYPH_SLOTS];
+  unsigned long glyph_upload = ada->lcd_glyph_dirty;
+  ada->lcd_glyph_dirty = 0;
+  for (int i = 0; i < LCD_GLYPH_SLOTS; ++i) {
+    glyphs[i] = ada->lcd_glyphs[i].bitmap;
+  }
+  mutex_unlock(&ada->lcd_lock);
+
+  // Backlight changes from here on go out with the cells
+  port_flush_begin(ada);
+
+  // Any failure makes the flush fail, in burst mode or not
+  int err = 0;
+
+  // Glyphs go first, the cells that show them come after
+  if (glyph_upload && lcd_upload_glyphs(ada, glyph_upload, glyphs)) {
+    mutex_lock(&ada->lcd_lock);
+    ada->lcd_glyph_dirty |= glyph_upload;
+    mutex_unlock(&ada->lcd_lock);
+    err = -EIO;
+  }
+
+  // Lines change width or place in DDRAM, rewrite all
+  if (frame_marquee != ada->lcd_frame_marquee) {
+    // marquee_work stops while there is no marquee in the frame,
+    // it starts again from here
+    if (!ada->lcd_frame_marquee) {
+      queue_delayed_work(ada->flusher_q, &ada->marquee_w, marquee_delay());
+    }
+    ada->lcd_frame_marquee = frame_marquee;
+    bitmap_fill(ada->lcd_frame_dirty, LCD_BUFFER_LENGTH);
+    if (!ada->lcd_shadow_wide) {
+      ada->lcd_shadow_valid = false;
+      ada->lcd_shadow_wide = true;
+    }
+  }
+
+  // Marquee over, shift the display back
+  if (!ada->lcd_frame_marquee && ada->lcd_shift) {
+    if (lcd_send_cmd(ada, 0x02)) {
+      ada->lcd_shadow_valid = false;
+      err = -EIO;
+    }
+    lcd_wait(ada, 2);
+    ada->lcd_shift = 0;
+  }
+
+  ada->flush_last = jiffies;
+  if (lcd_write_to_panel(ada)) {
+    err = -EIO;
+  }
+  ada->flush_error = err;
+  port_flush_end(ada);
+
+  ada->lcd_gen_shown = gen;
+  wake_up_interruptible_all(&ada->lcd_flushq);
+
+  stat_count(&ada->stats, &ada->stats.flushes);
+  stat_hist_add(&ada->stats, &ada->stats.flush_hist, ktime_to_ns(ktime_get()) - start);
+}
+
+// Ask for a flush, no earlier than the frame rate allows. Does
+// nothing if one is already pending, it will pick up the change.
+static void lcd_schedule_flush(struct ada *ada)
+{
+  unsigned long delay = 0;
+  int fps = max_fps;
+
+  if (fps > 0) {
+    unsigned long next = ada->flush_last + HZ / fps;
+    if (time_before(jiffies, next)) {
+      delay = next - jiffies;
+    }
+  }
+
+  queue_delayed_work(ada->flusher_q, &ada->flusher_w, delay);
+}
+
+// Tell readers of /dev/adalcdN about a change of a screen, and
+// the flusher too if the screen is visible
+static void lcd_changed(struct ada *ada, bool visible)
+{
+  if (visible) {
+    lcd_schedule_flush(ada);
+  }
+
+  wake_up_interruptible(&ada->lcd_changeq);
+  kill_fasync(&ada->lcd_fasync_queue, SIGIO, POLL_PRI);
+}
+
+// Take in changes made through a mapping to the cells of a
+// screen. These are not tracked so every cell is compared to the
+// panel.
+static void lcd_commit(struct ada *ada, int screen)
+{
+  mutex_lock(&ada->lcd_lock);
+  ++ada->lcd_screen_gen[screen];
+  bool visible = screen == lcd_visible(ada);
+  if (visible) {
+    bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+    ++ada->lcd_gen;
+  }
+  mutex_unlock(&ada->lcd_lock);
+
+  lcd_changed(ada, visible);
+}
+
+// Compositor: put another screen or the overlay on the panel,
+// with lcd_lock held. Only cells that differ from what the panel
+// shows are sent.
+static void lcd_show_locked(struct ada *ada, int screen, bool overlay)
+{
+  int before = lcd_visible(ada);
+
+  ada->lcd_active = screen;
+  ada->lcd_overlay_on = overlay;
+
+  if (lcd_visible(ada) != before) {
+    bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+    ++ada->lcd_gen;
+    lcd_schedule_flush(ada);
+  }
+}
+
+// Next or previous screen, for the button chords
+static void lcd_show_step(struct ada *ada, int step)
+{
+  mutex_lock(&ada->lcd_lock);
+  lcd_show_locked(ada, (ada->lcd_active + step + screens) % screens, ada->lcd_overlay_on);
+  mutex_unlock(&ada->lcd_lock);
+}
+
+// Wait until everything written so far is on the panel
+static int lcd_sync(struct ada *ada)
+{
+  mutex_lock(&ada->lcd_lock);
+  unsigned long gen = ada->lcd_gen;
+  mutex_unlock(&ada->lcd_lock);
+
+  // The panel may go away meanwhile, see flusher_exit()
+  int ret = wait_event_interruptible(ada->lcd_flushq,
+				     (long)(ACCESS_ONCE(ada->lcd_gen_shown) - gen) >= 0 ||
+				     !ACCESS_ONCE(ada->lcd_ready));
+  if (ret) return -ERESTARTSYS;
+  if (!ACCESS_ONCE(ada->lcd_ready)) return -ENODEV;
+
+  return ada->flush_error;
+}
+
+/* Marquee */
+
+// Shifts of the display a second
+static int marquee_speed = 4;
+
+module_param(marquee_speed, int, 0644);
+
+static unsigned long marquee_delay(void)
+{
+  int speed = clamp(marquee_speed, 1, HZ);
+  return HZ / speed;
+}
+
+// One step costs one command, only lines without marquee are
+// written again to stay in place. Runs on the flush queue so it
+// has the frame and the shadow to itself.
+static void marquee_work(struct work_struct *work)
+{
+  struct ada *ada = container_of(to_delayed_work(work), struct ada, marquee_w);
+
+  if (!ada->lcd_frame_marquee) return;
+
+  port_flush_begin(ada);
+
+  if (lcd_send_cmd(ada, 0x18)) { // Shift display left
+    ada->lcd_shadow_valid = false;
+  }
+  ada->lcd_shift = (ada->lcd_shift + 1) % LCD_DDRAM_LINE;
+
+  int line_offset = ada->lcd_frame_size.lines == 2 ? 40 : 20;
+  for (int line = 0; line < ada->lcd_frame_size.lines; ++line) {
+    if (!(ada->lcd_frame_marquee & (1 << line))) {
+      bitmap_set(ada->lcd_frame_dirty, line * line_offset, ada->lcd_frame_size.characters);
+    }
+  }
+  ada->flush_error = lcd_write_to_panel(ada);
+  port_flush_end(ada);
+
+  queue_delayed_work(ada->flusher_q, &ada->marquee_w, marquee_delay());
+}
+
+static int marquee_set(const char *val, const struct kernel_param *kp)
+{
+  unsigned int mask;
+
+  int err = kstrtouint(val, 0, &mask);
+  if (err) return err;
+
+  mutex_lock(&ada_panels_lock);
+
+  marquee = mask;
+
+  for (int i = 0; i < ADA_PANELS_MAX; ++i) {
+    struct ada *ada = ada_panels[i];
+    if (!ada) continue;
+
+    mutex_lock(&ada->lcd_lock);
+    ada->marquee = mask;
+    bitmap_fill(ada->lcd_dirty, LCD_BUFFER_LENGTH);
+    ++ada->lcd_gen;
+    mutex_unlock(&ada->lcd_lock);
+
+    lcd_schedule_flush(ada);
+    queue_delayed_work(ada->flusher_q, &ada->marquee_w, marquee_delay());
+  }
+
+  mutex_unlock(&ada_panels_lock);
+
+  return 0;
+}
+
+static struct kernel_param_ops marquee_ops = {
+  .set = marquee_set,
+  .get = param_get_uint
+};
+
+module_param_cb(marquee, &marquee_ops, &marquee, 0644);
+
+// The panel is initialized on the flush work queue so module load
+// does not wait for it. Until then nothing is flushed and opens of
+// /dev/adalcdN wait, or fail with EAGAIN if non-blocking.
+static void lcd_init_work(struct work_struct *work)
+{
+  struct ada *ada = container_of(work, struct ada, lcd_init_w);
+
+  lcd_init(ada);
+
+  // Show the initial buffer content
+  mutex_lock(&ada->lcd_lock);
+  ++ada->lcd_gen;
+  ada->lcd_ready = true;
+  mutex_unlock(&ada->lcd_lock);
+
+  wake_up_interruptible_all(&ada->lcd_readyq);
+  lcd_schedule_flush(ada);
+  queue_delayed_work(ada->flusher_q, &ada->marquee_w, marquee_delay());
+}
+
+static int flusher_init(struct ada *ada)
+{
+  // One work at a time, in order: the flusher, the marquee and
+  // the panel init share the frame and the shadow without a lock
+  ada->flusher_q = alloc_ordered_workqueue(MODULE_NAME "%d_flusher_q", 0, ada->index);
+  if (!ada->flusher_q) return -ENOMEM;
+
+  INIT_DELAYED_WORK(&ada->flusher_w, flusher_work);
+  INIT_DELAYED_WORK(&ada->marquee_w, marquee_work);
+  INIT_WORK(&ada->lcd_init_w, lcd_init_work);
+
+  queue_work(ada->flusher_q, &ada->lcd_init_w);
+
+  return 0;
+}
+
+// Open files may still write and queue flushes, which find the
+// panel not ready. The queue goes in ada_release().
+static void flusher_exit(struct ada *ada)
+{
+  cancel_work_sync(&ada->lcd_init_w);
+
+  mutex_lock(&ada->lcd_lock);
+  ada->lcd_ready = false;
+  mutex_unlock(&ada->lcd_lock);
+  wake_up_interruptible_all(&ada->lcd_flushq);
+
+  // The flusher may start the marquee, so it goes first
+  cancel_delayed_work_sync(&ada->flusher_w);
+  cancel_delayed_work_sync(&ada->marquee_w);
+  flush_workqueue(ada->flusher_q);
+}
+
+/************************************************************
+ * HD44780 model
+ */
+
+// What a panel on the mock backend would do with the pin changes
+// ada makes: a controller latching RS and D4-D7 when E falls,
+// starting in 8 bit mode until the function set, with DDRAM,
+// CGRAM, the address counter, entry mode and display shift.
+// Reading debugfs ada/N/mock_lcd shows the panel, checks it
+// against the visible screen once that has been flushed, and gives
+// the bus cost per frame. Writing it restarts the counting.
+
+static void mock_lcd_move(struct mock_lcd *l, int step)
+{
+  if (l->ac_cgram) {
+    l->ac = (l->ac + step) & (MOCK_CGRAM - 1);
+  } else if (!l->two_lines) {
+    l->ac = (l->ac + 80 + step) % 80;
+  } else {
+    // Two lines of 40 at 0x00 and 0x40
+    int line = l->ac & 0x40;
+    int col = (l->ac & 0x3F) + step;
+    if (col < 0) {
+      line ^= 0x40;
+      col = LCD_DDRAM_LINE - 1;
+    } else if (col >= LCD_DDRAM_LINE) {
+      line ^= 0x40;
+      col = 0;
+    }
+    l->ac = line | col;
+  }
+}
+
+static void mock_lcd_shift(struct mock_lcd *l, int step)
+{
+  l->shift = (l->shift + LCD_DDRAM_LINE + step) % LCD_DDRAM_LINE;
+}
+
+static void mock_lcd_execute(struct mock_lcd *l, bool rs, u8 b)
+{
+  int step = l->increment ? 1 : -1;
+
+  if (rs) {
+    ++l->datas;
+    if (l->ac_cgram) {
+      l->cgram[l->ac] = b;
+    } else {
+      l->ddram[l->ac & (MOCK_DDRAM - 1)] = b;
+      if (l->shift_on_write) {
+	mock_lcd_shift(l, step);
+      }
+    }
+    mock_lcd_move(l, step);
+    return;
+  }
+
+  ++l->cmds;
+  if (b & 0x80) {
+    l->ac = b & 0x7F;
+    l->ac_cgram = false;
+  } else if (b & 0x40) {
+    l->ac = b & 0x3F;
+    l->ac_cgram = true;
+  } else if (b & 0x20) {
+    l->four_bit = !(b & 0x10);
+    l->two_lines = b & 0x08;
+  } else if (b & 0x10) {
+    if (b & 0x08) {
+      mock_lcd_shift(l, b & 0x04 ? -1 : 1);
+    } else {
+      mock_lcd_move(l, b & 0x04 ? 1 : -1);
+    }
+  } else if (b & 0x08) {
+    l->display_on = b & 0x04;
+  } else if (b & 0x04) {
+    l->increment = b & 0x02;
+    l->shift_on_write = b & 0x01;
+  } else if (b & 0x02) {
+    l->ac = 0;
+    l->ac_cgram = false;
+    l->shift = 0;
+  } else if (b & 0x01) {
+    memset(l->ddram, ' ', MOCK_DDRAM);
+    l->ac = 0;
+    l->ac_cgram = false;
+    l->increment = true;
+    l->shift = 0;
+  }
+}
+
+// With the mock lock held
+static void mock_lcd_edge(struct mock_lcd *l, u16 before, u16 after)
+{
+  if (!(before & PIN(LCD_E)) || (after & PIN(LCD_E))) return;
+
+  u8 n = lcd_pins_nybble(before);
+  bool rs = before & PIN(LCD_RS);
+
+  if (before & PIN(LCD_RW)) {
+    // Reads go by nybbles too, a data read moves the address
+    // counter once the byte is out
+    if (l->four_bit) {
+      l->low_nybble = !l->low_nybble;
+    }
+    if (!l->low_nybble) {
+      ++l->reads;
+      if (rs) {
+	mock_lcd_move(l, l->increment ? 1 : -1);
+      }
+    }
+    return;
+  }
+
+  if (!l->four_bit) {
+    // D0-D3 are not wired, they read low
+    mock_lcd_execute(l, rs, n << 4);
+  } else if (!l->low_nybble) {
+    l->high = n;
+    l->low_nybble = true;
+  } else {
+    l->low_nybble = false;
+    mock_lcd_execute(l, rs, l->high << 4 | n);
+  }
+}
+
+// Pins with the data pins that are inputs as the controller
+// drives them while RW and E are high: with RS low the busy flag,
+// never set here, and the address counter, with RS high the data
+// at the address counter. High nybble first. With the mock lock
+// held.
+static u16 mock_lcd_pins(const struct mock_lcd *l, u16 latch, u8 iodirb)
+{
+  u16 inputs = (iodirb << 8) & LCD_DATA;
+
+  if ((latch & (PIN(LCD_RW) | PIN(LCD_E))) != (PIN(LCD_RW) | PIN(LCD_E))) {
+    return latch;
+  }
+
+  u8 b = l->ac & 0x7F;
+  if (latch & PIN(LCD_RS)) {
+    b = l->ac_cgram ? l->cgram[l->ac] : l->ddram[l->ac & (MOCK_DDRAM - 1)];
+  }
+  u16 driven = lcd_nybble_pins(l->four_bit && l->low_nybble ? b : b >> 4);
+
+  return (latch & ~inputs) | (driven & inputs);
+}
+
+// DDRAM address shown at a cell of a line
+static int mock_lcd_address(const struct mock_lcd *l, int line, int col, bool marquee_line)
+{
+  int start = line_starts[line];
+  int shift = marquee_line ? 0 : l->shift;
+  return (start & 0x40) | ((start & 0x3F) + col + shift) % LCD_DDRAM_LINE;
+}
+
+// Compare the panel to the visible screen, 0 if it matches,
+// 1 if it differs, -EAGAIN if the screen has not been flushed yet
+static int mock_lcd_verify(struct ada *ada, struct seq_file *m, const struct mock_lcd *l)
+{
+  int ret = 0;
+
+  mutex_lock(&ada->lcd_lock);
+  if (ada->lcd_gen_shown != ada->lcd_gen || !bitmap_empty(ada->lcd_dirty, LCD_BUFFER_LENGTH)) {
+    ret = -EAGAIN;
+    goto out;
+  }
+
+  int line_offset = ada->lcd_size.lines == 2 ? 40 : 20;
+  unsigned int marquee_lines = lcd_marquee_lines(ada->marquee, &ada->lcd_size);
+  const char *cells = lcd_screen(ada, lcd_visible(ada));
+
+  for (int line = 0; line < ada->lcd_size.lines; ++line) {
+    bool marquee_line = marquee_lines & (1 << line);
+    int width = marquee_line ? LCD_DDRAM_LINE : ada->lcd_size.characters;
+    for (int col = 0; col < width; ++col) {
+      u8 shown = l->ddram[mock_lcd_address(l, line, col, marquee_line)];
+      u8 cell = cells[line * line_offset + col];
+      if (shown != cell) {
+	seq_printf(m, "verify line %d col %d shows %02x, cell is %02x\n",
+		   line, col, shown, cell);
+	ret = 1;
+	goto out;
+      }
+    }
+  }
+
+ out:
+  mutex_unlock(&ada->lcd_lock);
+  return ret;
+}
+
+static int mock_lcd_show(struct seq_file *m, void *v)
+{
+  struct ada *ada = m->private;
+  struct ada_mock *mk = ada->mock;
+
+  // A copy, printing may sleep
+  struct mock_lcd *l = kmalloc(sizeof(*l), GFP_KERNEL);
+  struct mock_bus bus;
+  unsigned long flags;
+
+  if (!l) return -ENOMEM;
+
+  spin_lock_irqsave(&mk->lock, flags);
+  *l = mk->lcd;
+  bus.xfers = mk->bus.xfers - mk->bus_base.xfers;
+  bus.clocks = mk->bus.clocks - mk->bus_base.clocks;
+  unsigned long flushes_base = mk->flushes_base;
+  spin_unlock_irqrestore(&mk->lock, flags);
+
+  struct ada_stats *st = &ada->stats;
+  spin_lock_irqsave(&st->lock, flags);
+  // Since the reset here, or the one of all statistics
+  unsigned long frames = st->flushes >= flushes_base ?
+    st->flushes - flushes_base : st->flushes;
+  spin_unlock_irqrestore(&st->lock, flags);
+
+  mutex_lock(&ada->lcd_lock);
+  struct lcd_size size = ada->lcd_size;
+  mutex_unlock(&ada->lcd_lock);
+
+  for (int line = 0; line < size.lines; ++line) {
+    seq_putc(m, '|');
+    for (int col = 0; col < size.characters; ++col) {
+      u8 c = l->ddram[mock_lcd_address(l, line, col, false)];
+      seq_putc(m, c >= ' ' && c < 0x7F ? c : '.');
+    }
+    seq_puts(m, "|\n");
+  }
+
+  seq_printf(m, "display %s ac %02x%s shift %d\n",
+	     l->display_on ? "on" : "off", l->ac,
+	     l->ac_cgram ? " cgram" : "", l->shift);
+  seq_printf(m, "commands %lu data %lu reads %lu\n",
+	     l->cmds, l->datas, l->reads);
+  seq_printf(m, "xfers %lu bus_us %llu at %u kHz\n", bus.xfers,
+	     div_u64(mock_bus_ns(bus.clocks), NSEC_PER_USEC), mock_i2c_khz);
+  seq_printf(m, "frames %lu xfers/frame %lu bus_us/frame %llu\n", frames,
+	     frames ? bus.xfers / frames : 0,
+	     frames ? div_u64(mock_bus_ns(div_u64(bus.clocks, frames)), NSEC_PER_USEC) : 0);
+
+  int err = mock_lcd_verify(ada, m, l);
+  if (!err) {
+    seq_puts(m, "verify ok\n");
+  } else if (err < 0) {
+    seq_puts(m, "verify pending\n");
+  }
+
+  kfree(l);
+  return 0;
+}
+
+static int mock_lcd_open(struct inode *inode, struct file *filp)
+{
+  return single_open(filp, mock_lcd_show, inode->i_private);
+}
+
+static ssize_t mock_lcd_reset_write(struct file *filp, const char __user *ubuff,
+				    size_t len, loff_t *offs)
+{
+  struct seq_file *m = filp->private_data;
+  struct ada *ada = m->private;
+  struct ada_mock *mk = ada->mock;
+  unsigned long flags;
+
+  spin_lock_irqsave(&ada->stats.lock, flags);
+  unsigned long flushes = ada->stats.flushes;
+  spin_unlock_irqrestore(&ada->stats.lock, flags);
+
+  spin_lock_irqsave(&mk->lock, flags);
+  mk->bus_base = mk->bus;
+  mk->flushes_base = flushes;
+  mk->lcd.cmds = 0;
+  mk->lcd.datas = 0;
+  mk->lcd.reads = 0;
+  spin_unlock_irqrestore(&mk->lock, flags);
+
+  return len;
+}
+
+static struct file_operations mock_lcd_fileops = {
+  .owner = THIS_MODULE,
+  .open = mock_lcd_open,
+  .read = seq_read,
+  .write = mock_lcd_reset_write,
+  .llseek = seq_lseek,
+  .release = single_release
+};
+
+// Power on state: 8 bit mode, one line, cursor moves right
+static void mock_lcd_init(struct ada *ada)
+{
+  struct ada_mock *mk = ada->mock;
+
+  memset(&mk->lcd, 0, sizeof(mk->lcd));
+  memset(mk->lcd.ddram, ' ', MOCK_DDRAM);
+  mk->lcd.increment = true;
+  memset(&mk->bus_base, 0, sizeof(mk->bus_base));
+  mk->flushes_base = 0;
+
+  if (ada->stats.dir) {
+    debugfs_create_file("mock_lcd", 0644, ada->stats.dir, ada, &mock_lcd_fileops);
+  }
+}
+
+/************************************************************
+ * Write stream parser
+ */
+
+#define NCOLS parser->ada->lcd_size.characters
+#define NROWS parser->ada->lcd_size.lines
+
+/* Parser state */
+
+// CSI parameters kept, ESC[r0;...;r7g has the most
+#define ANSI_PARAMS_MAX 8
+
+typedef struct write_stream_parser {
+  struct ada *ada;
+  int col;
+  int row;
+  int line_len;
+  int clear_from;
+  int clear_count;
+  int ansi_param[ANSI_PARAMS_MAX]; // -1 when left out
+  int ansi_count;
+  int ansi_value;          // Current parameter so far
+  int ansi_digits;
+  int screen;              // Screen written to and its cells
+  char *cells;
+  const char *buffer;
+  size_t len;
+  int index;
+  bool fast;               // parse_fast for this buffer
+  void (*state_fn) (struct write_stream_parser *);
+} write_stream_parser_t;
 
 /* Parser state function protos */
 static void wsp_scroll(write_stream_parser_t *parser);
 static void wsp_copy(write_stream_parser_t *parser);
 static void wsp_clear(write_stream_parser_t *parser);
 static void wsp_csi(write_stream_parser_t *parser);
-static void wsp_ansi_n(write_stream_parser_t *parser);
-static void wsp_ansi_m(write_stream_parser_t *parser);
+static void wsp_csi_param(write_stream_parser_t *parser);
 static void wsp_ed(write_stream_parser_t *parser);
 static void wsp_cup(write_stream_parser_t *parser);
+static void wsp_glyph(write_stream_parser_t *parser);
+
+/* Parser state functions */
+
+// Copy runs of text with one memcpy instead of a state function
+// call per character. Can be turned off for comparison.
+static bool parse_fast = true;
+
+module_param(parse_fast, bool, 0644);
+
+#define ESC 0x1B
+
+// Does the word w contain byte c
+#define HAS_BYTE(w, c) \
+  ((((w) ^ REPEAT_BYTE(c)) - REPEAT_BYTE(0x01)) & \
+   ~((w) ^ REPEAT_BYTE(c)) & REPEAT_BYTE(0x80))
+
+// Length of text before the next ESC or newline, at most max,
+// looking at a word at a time where possible
+static size_t wsp_text_len(const char *text, size_t max)
+{
+  size_t n = 0;
+
+  while (n < max && ((unsigned long)(text + n) & (sizeof(long) - 1))) {
+    if (text[n] == ESC || text[n] == '\n') return n;
+    ++n;
+  }
+
+  while (n + sizeof(long) <= max) {
+    unsigned long w = *(const unsigned long *)(text + n);
+    if (HAS_BYTE(w, ESC) | HAS_BYTE(w, '\n')) break;
+    n += sizeof(long);
+  }
+
+  while (n < max && text[n] != ESC && text[n] != '\n') {
+    ++n;
+  }
+
+  return n;
+}
+
+// Copy text up to the next control character or the end of the
+// line, whichever comes first
+static void wsp_copy_run(write_stream_parser_t *parser)
+{
+  int width = lcd_line_width(parser->ada, parser->row);
+  size_t max = parser->len - parser->index;
+  size_t room = parser->col < width ? width - parser->col : 0;
+  if (max > room) {
+    max = room;
+  }
+
+  const char *text = parser->buffer + parser->index;
+  size_t n = wsp_text_len(text, max);
+
+  int lcd_index = parser->col + parser->row * parser->line_len;
+  memcpy(parser->cells + lcd_index, text, n);
+  lcd_mark_dirty(parser->ada, parser->screen, lcd_index, n);
+
+  parser->index += n;
+  parser->col += n;
+  if (parser->col >= width) {
+    parser->col = 0;
+    ++parser->row;
+  }
+}
+
+static void wsp_copy(write_stream_parser_t *parser)
+{
+  if (parser->buffer[parser->index] == ESC) {
+    ++parser->index;
+    parser->state_fn = wsp_csi;
+    return;
+  }
+
+  // -- scroll if past the last line, also before a newline
+  // so that row never goes beyond NROWS
+  if (parser->row == NROWS) {
+    parser->state_fn = wsp_scroll;
+    return;
+  }
+
+  // State change conditions
+  if (parser->buffer[parser->index] == '\n') {
+    ++parser->index;
+    ++parser->row;
+    parser->col = 0;
+    return;
+  }
+
+  // In state process
+  if (parser->fast) {
+    wsp_copy_run(parser);
+    return;
+  }
+
+  int lcd_index = parser->col + parser->row * parser->line_len;
+  parser->cells[lcd_index] = parser->buffer[parser->index];
+  lcd_mark_dirty(parser->ada, parser->screen, lcd_index, 1);
+  ++parser->index;
+  if (++parser->col >= lcd_line_width(parser->ada, parser->row)) {
+    parser->col = 0;
+    ++parser->row;
+  }
+}
+
+static void wsp_scroll(write_stream_parser_t *parser)
+{
+  switch (NROWS) {
+  case 1:
+    parser->clear_from = 0;
+    parser->clear_count = 80;
+    break;
+  case 2:
+    memmove(parser->cells, parser->cells + 40, 40);
+    parser->clear_from = 40;
+    parser->clear_count = 40;
+    break;
+  case 4:
+    memmove(parser->cells, parser->cells + 20, 60);
+    parser->clear_from = 60;
+    parser->clear_count = 20;
+    break;
+  }
+  --parser->row;
+
+  lcd_mark_dirty(parser->ada, parser->screen, 0, LCD_BUFFER_LENGTH - parser->clear_count);
+  
+  parser->state_fn = wsp_clear;
+}
+
+static void wsp_clear(write_stream_parser_t *parser)
+{
+  if (parser->clear_from + parser->clear_count > LCD_BUFFER_LENGTH) {
+    parser->clear_count = LCD_BUFFER_LENGTH - parser->clear_from;
+  }
+  lcd_mark_dirty(parser->ada, parser->screen, parser->clear_from, parser->clear_count);
 
-/* Parser state functions */
+  memset(parser->cells + parser->clear_from, ' ', parser->clear_count);
+  parser->clear_from += parser->clear_count;
+  parser->clear_count = 0;
 
-static void wsp_copy(write_stream_parser_t *parser)
+  parser->state_fn = wsp_copy;
+}
+
+static void wsp_csi(write_stream_parser_t *parser)
+{
+  // Ignore lone ESC, assume next character is printable
+  // even though in real ANSI that isn't really so
+  if (parser->buffer[parser->index] != '[') {
+    parser->state_fn = wsp_copy;
+    return;
+  }
+
+  ++parser->index;
+  
+  // Parameters may arrive in a later write, so a parameter is
+  // known to be left out only when it ends, not by looking ahead
+  parser->ansi_count = 0;
+  parser->ansi_value = 0;
+  parser->ansi_digits = 0;
+  parser->state_fn = wsp_csi_param;  
+}
+
+static void wsp_param_end(write_stream_parser_t *parser)
+{
+  if (parser->ansi_count < ANSI_PARAMS_MAX) {
+    parser->ansi_param[parser->ansi_count++] =
+      parser->ansi_digits ? parser->ansi_value : -1;
+  }
+  parser->ansi_value = 0;
+  parser->ansi_digits = 0;
+}
+
+// Parameter i, or def if it was left out
+static int wsp_param(write_stream_parser_t *parser, int i, int def)
+{
+  if (i >= parser->ansi_count || parser->ansi_param[i] < 0) {
+    return def;
+  }
+  return parser->ansi_param[i];
+}
+
+static void wsp_csi_param(write_stream_parser_t *parser)
 {
-  if (parser->buffer[parser->index] == 0x1B /*ESC*/) {
+  char c = parser->buffer[parser->index];
+
+  if ('0' <= c && c <= '9') {
+    if (parser->ansi_value < 10000) {
+      parser->ansi_value = parser->ansi_value * 10 + c - '0';
+    }
+    ++parser->ansi_digits;
     ++parser->index;
-    parser->state_fn = wsp_csi;
     return;
   }
 
-  // State change conditions
-  if (parser->buffer[parser->index] == '\n') {
+  switch (c) {
+  case ';':
     ++parser->index;
-    ++parser->row;
-    parser->col = 0;
+    wsp_param_end(parser);
+    return;
+  case 'J':
+    parser->state_fn = wsp_ed;
+    break;
+  case 'H':
+    parser->state_fn = wsp_cup;
+    break;
+  case 'g':
+    parser->state_fn = wsp_glyph;
+    break;
+  default:
+    // Others treated as normal text
+    parser->state_fn = wsp_copy;
     return;
   }
 
-  // -- scroll if on last line
-  if (parser->row == NROWS) {
-    parser->state_fn = wsp_scroll;
+  ++parser->index;
+  wsp_param_end(parser);
+}
+
+static void wsp_ed(write_stream_parser_t *parser)
+{
+  int lcd_index = parser->col + parser->row * parser->line_len;
+
+  switch (wsp_param(parser, 0, 0)) {
+  case 0:
+    // n == 0: clear form cursor to end
+    parser->clear_from = lcd_index;
+    parser->clear_count = 80 - lcd_index;
+    break;
+  case 1:
+    // n == 1: clear from beginning to cursor
+    parser->clear_from = 0;
+    parser->clear_count = lcd_index + 1;
+    break;
+  case 2:
+    // n == 2: clear entire screen
+    parser->clear_from = 0;
+    parser->clear_count = 80;
+    break;
+  default:
+    parser->state_fn = wsp_copy;
     return;
   }
+  parser->state_fn = wsp_clear;
+}
+
+static void wsp_cup(write_stream_parser_t *parser)
+{
+  // go to n,m (n, m are 1 based, 0 counts as 1)
+  int row = max(wsp_param(parser, 0, 1) - 1, 0);
+  int col = max(wsp_param(parser, 1, 1) - 1, 0);
+  if (row >= NROWS) {
+    row = NROWS - 1;
+  }
+  if (col >= lcd_line_width(parser->ada, row)) {
+    col = lcd_line_width(parser->ada, row) - 1;
+  }
+  parser->row = row;
+  parser->col = col;
+
+  parser->state_fn = wsp_copy;
+}
+
+// ESC[r0;...;r7g puts a custom glyph at the cursor, rows from the
+// top with the leftmost dot in bit 4
+static void wsp_glyph(write_stream_parser_t *parser)
+{
+  u64 bitmap = 0;
+  for (int r = 0; r < 8; ++r) {
+    bitmap |= (u64)(wsp_param(parser, r, 0) & 0x1F) << (8 * r);
+  }
+
+  parser->state_fn = wsp_copy;
+
+  int slot = lcd_glyph_get(parser->ada, bitmap);
+  if (slot < 0) return;
+
+  if (parser->row == NROWS) {
+    wsp_scroll(parser);
+    wsp_clear(parser);
+  }
+
+  int lcd_index = parser->col + parser->row * parser->line_len;
+  parser->cells[lcd_index] = slot;
+  lcd_mark_dirty(parser->ada, parser->screen, lcd_index, 1);
+  if (++parser->col >= lcd_line_width(parser->ada, parser->row)) {
+    parser->col = 0;
+    ++parser->row;
+  }
+}
+
+/* Parser state driver */
+
+static void wsp_init(write_stream_parser_t *parser, struct ada *ada, int screen)
+{
+  parser->ada = ada;
+  parser->screen = screen;
+  parser->cells = lcd_screen(parser->ada, screen);
+  parser->col = 0;
+  parser->row = 0;
+  parser->len = 0;
+  parser->state_fn = wsp_copy;
+} 
+
+static void wsp_process_init(write_stream_parser_t *parser, const char *buffer, size_t len,
+			     bool fast)
+{
+  parser->buffer = buffer;
+  parser->len = len;
+  parser->index = 0;
+  parser->fast = fast;
+  parser->line_len = LCD_BUFFER_LENGTH / NROWS;
+
+  // The geometry may have changed since the last write, by lcd_size
+  // or marquee. Bring the cursor back onto the screen, a column past
+  // the line wraps as a write there would have. Row NROWS is a
+  // scroll waiting for the next character, always at column 0.
+  if (parser->row < NROWS &&
+      parser->col >= lcd_line_width(parser->ada, parser->row)) {
+    parser->col = 0;
+    ++parser->row;
+  }
+  if (parser->row >= NROWS) {
+    parser->row = NROWS;
+    parser->col = 0;
+  }
+} 
+
+// States that act on what was already parsed, they run even
+// when the input ends so that a write ending with a complete
+// escape sequence shows its effect
+static bool wsp_pending(write_stream_parser_t *parser)
+{
+  return parser->state_fn == wsp_ed ||
+    parser->state_fn == wsp_cup ||
+    parser->state_fn == wsp_glyph ||
+    parser->state_fn == wsp_clear;
+}
+
+static void wsp_process(write_stream_parser_t *parser)
+{
+  while (parser->index < parser->len || wsp_pending(parser)) {
+    parser->state_fn(parser);
+  }
+}
+
+/* Parser benchmark */
+
+// Writing N to parse_bench parses N KiB of generated log text
+// with and without the fast path, reading it gives the parse
+// rates. The cells of screen 0 of the first panel and what is
+// waiting to be flushed are left as they were, parse_fast of
+// other writers is not touched.
+
+static char parse_bench_result[80];
+
+static void parse_bench_fill(char *stream, size_t len)
+{
+  static const char text[] =
+    "0123456789 abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+  static const char home[] = "\x1B[1;1H";
+  u32 seed = 1;
+  size_t i = 0;
+
+  while (i < len) {
+    seed = seed * 1103515245 + 12345;
+
+    // Now and then a cursor move, mostly lines of 8-63 characters
+    if ((seed >> 8) % 8 == 0 && i + sizeof(home) - 1 <= len) {
+      memcpy(stream + i, home, sizeof(home) - 1);
+      i += sizeof(home) - 1;
+    }
+
+    int line = 8 + (seed >> 16) % 56;
+    for (int j = 0; j < line && i < len; ++j, ++i) {
+      stream[i] = text[(seed + j) % (sizeof(text) - 1)];
+    }
+    if (i < len) {
+      stream[i++] = '\n';
+    }
+  }
+}
+
+static int parse_bench_set(const char *val, const struct kernel_param *kp)
+{
+  int kib;
+
+  int n_read = sscanf(val, "%d", &kib);
+  if (n_read != 1) return -EINVAL;
+  if (kib <= 0 || kib > 16384) return -EINVAL;
+
+  struct ada *ada = ada_get_first();
+  if (!ada) return -ENODEV;
+
+  size_t len = kib * 1024;
+  char *stream = vmalloc(len);
+  if (!stream) {
+    ada_put(ada);
+    return -ENOMEM;
+  }
+
+  parse_bench_fill(stream, len);
+
+  u64 rate[2];
+  char saved[LCD_BUFFER_LENGTH];
+  DECLARE_BITMAP(saved_dirty, LCD_BUFFER_LENGTH);
+
+  mutex_lock(&ada->lcd_lock);
+  memcpy(saved, lcd_screen(ada, 0), LCD_BUFFER_LENGTH);
+  bitmap_copy(saved_dirty, ada->lcd_dirty, LCD_BUFFER_LENGTH);
+
+  for (int i = 0; i < 2; ++i) {
+    write_stream_parser_t parser;
+    wsp_init(&parser, ada, 0);
+
+    u64 start = ktime_to_ns(ktime_get());
+    wsp_process_init(&parser, stream, len, i);
+    wsp_process(&parser);
+    u64 ns = ktime_to_ns(ktime_get()) - start;
+
+    rate[i] = div64_u64((u64)len * NSEC_PER_SEC, ns ? ns : 1);
+  }
+
+  memcpy(lcd_screen(ada, 0), saved, LCD_BUFFER_LENGTH);
+  bitmap_copy(ada->lcd_dirty, saved_dirty, LCD_BUFFER_LENGTH);
+  mutex_unlock(&ada->lcd_lock);
+
+  vfree(stream);
+  ada_put(ada);
+
+  snprintf(parse_bench_result, sizeof(parse_bench_result),
+	   "%d KiB: %llu B/s per byte, %llu B/s fast",
+	   kib, (unsigned long long)rate[0], (unsigned long long)rate[1]);
+  printk(KERN_INFO MODULE_NAME ": parse_bench %s\n", parse_bench_result);
+
+  return 0;
+}
+
+static int parse_bench_get(char *val, const struct kernel_param *kp)
+{
+  return sprintf(val, "%s", parse_bench_result);
+}
+
+static struct kernel_param_ops parse_bench_ops = {
+  .set = parse_bench_set,
+  .get = parse_bench_get
+};
+
+module_param_cb(parse_bench, &parse_bench_ops, NULL, 0644);
+
+/************************************************************
+ * LCD file ops
+ */
+
+// Text writes are copied from user space and parsed this much
+// at a time
+#define LCD_WRITE_CHUNK 256
+
+// Longest text read: all cells and a newline per line
+#define LCD_TEXT_LENGTH (LCD_BUFFER_LENGTH + 4)
+
+typedef struct {
+  struct ada *ada;
+  write_stream_parser_t parser;
+  int screen;              // Screen read and written
+  unsigned long seen_gen;  // Generation of the screen last read
+  bool cells;              // Reads and writes at cell offsets
+  struct mutex write_lock; // Writers sharing this file take turns
+  char chunk[LCD_WRITE_CHUNK];
+} lcd_file_state_t;
+
+// Minor N is /dev/adalcdN
+static int lcd_open(struct inode *inode, struct file *filp)
+{
+  struct ada *ada = ada_get(iminor(inode));
+  if (!ada) return -ENODEV;
+
+  int err = 0;
+  if (!ACCESS_ONCE(ada->lcd_ready)) {
+    if (filp->f_flags & O_NONBLOCK) {
+      err = -EAGAIN;
+    } else {
+      err = wait_event_interruptible(ada->lcd_readyq,
+				     ACCESS_ONCE(ada->lcd_ready) || ACCESS_ONCE(ada->gone));
+    }
+  }
+  if (!err && ACCESS_ONCE(ada->gone)) {
+    err = -ENODEV;
+  }
+
+  lcd_file_state_t *fs = NULL;
+  if (!err) {
+    fs = kmalloc(sizeof(lcd_file_state_t), GFP_KERNEL);
+    if (!fs) err = -ENOMEM;
+  }
+  if (err) {
+    ada_put(ada);
+    return err;
+  }
+
+  filp->private_data = fs;
+
+  fs->ada = ada;
+  fs->screen = 0;
+  fs->seen_gen = ACCESS_ONCE(ada->lcd_screen_gen[0]);
+  fs->cells = false;
+  mutex_init(&fs->write_lock);
+  wsp_init(&fs->parser, ada, 0);
+
+  return 0;
+}
+
+// Cells of the current geometry in row order, without the
+// padding a screen has after each line
+static int lcd_cells(struct ada *ada, char *cells, const char *screen_cells)
+{
+  int cols = ada->lcd_size.characters;
+  int line_len = LCD_BUFFER_LENGTH / ada->lcd_size.lines;
+
+  for (int line = 0; line < ada->lcd_size.lines; ++line) {
+    memcpy(cells + line * cols, screen_cells + line * line_len, cols);
+  }
+  return cols * ada->lcd_size.lines;
+}
+
+// Text mode reads the display as lines of text, cell mode reads
+// the cells, both from the file offset on
+static ssize_t lcd_read(
+    struct file *filp, char __user *ubuff, size_t len, loff_t *offs)
+{
+  lcd_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+  char text[LCD_TEXT_LENGTH];
+  int tlen;
+
+  mutex_lock(&ada->lcd_lock);
+  if (fs->cells) {
+    tlen = lcd_cells(ada, text, lcd_screen(ada, fs->screen));
+  } else {
+    tlen = output_display(&ada->lcd_size, text, lcd_screen(ada, fs->screen));
+  }
+  fs->seen_gen = ada->lcd_screen_gen[fs->screen];
+  mutex_unlock(&ada->lcd_lock);
+
+  if (*offs >= tlen) return 0;
+
+  if (len > tlen - *offs) {
+    len = tlen - *offs;
+  }
+
+  if (copy_to_user(ubuff, text + *offs, len)) return -EFAULT;
+
+  *offs += len;
+  return len;
+}
+
+// Count a write by this file as a change of its screen, with
+// lcd_lock held. Tells if the screen is visible.
+static bool lcd_write_gen(lcd_file_state_t *fs)
+{
+  struct ada *ada = fs->ada;
+  unsigned long *gen = &ada->lcd_screen_gen[fs->screen];
+
+  // Own writes are no news to this file if it was up to date
+  if (fs->seen_gen == *gen) {
+    ++fs->seen_gen;
+  }
+  ++*gen;
+
+  if (fs->screen != lcd_visible(ada)) return false;
+
+  ++ada->lcd_gen;
+  return true;
+}
+
+// Cell mode write, *offs is row * columns + col
+static ssize_t lcd_write_cells(
+    lcd_file_state_t *fs, const char __user *ubuff, size_t len, loff_t *offs)
+{
+  struct ada *ada = fs->ada;
+  char cells[LCD_BUFFER_LENGTH];
+
+  if (len == 0) return 0;
+  if (len > LCD_BUFFER_LENGTH) {
+    len = LCD_BUFFER_LENGTH;
+  }
+  if (copy_from_user(cells, ubuff, len)) return -EFAULT;
+
+  mutex_lock(&ada->lcd_lock);
+
+  int cols = ada->lcd_size.characters;
+  int size = cols * ada->lcd_size.lines;
+  int line_len = LCD_BUFFER_LENGTH / ada->lcd_size.lines;
+
+  if (*offs >= size) {
+    mutex_unlock(&ada->lcd_lock);
+    return -ENOSPC;
+  }
+
+  int pos = *offs;
+  if (len > size - pos) {
+    len = size - pos;
+  }
+
+  // One run per display line touched
+  for (int done = 0; done < len; ) {
+    int col = (pos + done) % cols;
+    int n = min_t(int, cols - col, len - done);
+    int lcd_index = (pos + done) / cols * line_len + col;
+
+    memcpy(lcd_screen(ada, fs->screen) + lcd_index, cells + done, n);
+    lcd_mark_dirty(ada, fs->screen, lcd_index, n);
+    done += n;
+  }
+
+  bool visible = lcd_write_gen(fs);
+  mutex_unlock(&ada->lcd_lock);
+
+  lcd_changed(ada, visible);
+
+  *offs += len;
+  return len;
+}
+
+// Text mode writes go through the parser a chunk at a time, all
+// of the write is consumed
+static ssize_t lcd_write(struct file *filp, const char __user *ubuff, size_t len, loff_t *offs)
+{
+  lcd_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+
+  stat_count(&ada->stats, &ada->stats.writes);
+
+  if (fs->cells) {
+    return lcd_write_cells(fs, ubuff, len, offs);
+  }
+
+  if (len == 0) return 0;
+
+  size_t done = 0;
+  bool visible = false;
+
+  mutex_lock(&fs->write_lock);
+  while (done < len) {
+    size_t n = min_t(size_t, len - done, LCD_WRITE_CHUNK);
+
+    if (copy_from_user(fs->chunk, ubuff + done, n)) break;
+
+    mutex_lock(&ada->lcd_lock);
+    wsp_process_init(&fs->parser, fs->chunk, n, ACCESS_ONCE(parse_fast));
+    wsp_process(&fs->parser);
+    visible |= lcd_write_gen(fs);
+    mutex_unlock(&ada->lcd_lock);
+
+    done += n;
+  }
+  mutex_unlock(&fs->write_lock);
+
+  if (done == 0) return -EFAULT;
+
+  lcd_changed(ada, visible);
+
+  return done;
+}
+
+// msync(MS_SYNC) of a mapping ends up here too
+static int lcd_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+  lcd_file_state_t *fs = filp->private_data;
+
+  lcd_commit(fs->ada, fs->screen);
+  return lcd_sync(fs->ada);
+}
+
+// The cells of all screens, in place. Changes are shown after
+// msync(), fsync(), ADA_IOC_COMMIT or ADA_IOC_SYNC.
+static int lcd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  lcd_file_state_t *fs = filp->private_data;
 
-  // In state process
-  int lcd_index = parser->col + parser->row * 80 / NROWS;
-  lcd_buffer[lcd_index] = parser->buffer[parser->index];
-  ++parser->index;
-  if (++parser->col == NCOLS) {
-    parser->col = 0;
-    ++parser->row;
+  if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE) {
+    return -EINVAL;
   }
+
+  vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+  return remap_pfn_range(vma, vma->vm_start,
+			 virt_to_phys(fs->ada->lcd_buffer) >> PAGE_SHIFT,
+			 vma->vm_end - vma->vm_start, vma->vm_page_prot);
 }
 
-static void wsp_scroll(write_stream_parser_t *parser)
+// The file position ranges over the text or the cells of the
+// current geometry. Text mode writes don't use it.
+static loff_t lcd_llseek(struct file *filp, loff_t offset, int whence)
 {
-  switch (NROWS) {
-  case 1:
-    parser->clear_from = 0;
-    parser->clear_count = 80;
+  lcd_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+
+  loff_t size = ada->lcd_size.characters * ada->lcd_size.lines;
+  if (!fs->cells) {
+    size += ada->lcd_size.lines;
+  }
+
+  switch (whence) {
+  case SEEK_SET:
     break;
-  case 2:
-    for (int i = 0; i < 40; ++i) {
-      lcd_buffer[i] = lcd_buffer[i+40];
-    }
-    parser->clear_from = 40;
-    parser->clear_count = 40;
+  case SEEK_CUR:
+    offset += filp->f_pos;
     break;
-  case 4:
-    for (int i = 0; i < 60; ++i) {
-      lcd_buffer[i] = lcd_buffer[i+20];
-    }
-    parser->clear_from = 60;
-    parser->clear_count = 20;
+  case SEEK_END:
+    offset += size;
     break;
+  default:
+    return -EINVAL;
   }
-  --parser->row;
-  
-  parser->state_fn = wsp_clear;
+
+  if (offset < 0 || offset > size) return -EINVAL;
+
+  filp->f_pos = offset;
+  return offset;
 }
 
-static void wsp_clear(write_stream_parser_t *parser)
+static long lcd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-  while (parser->clear_count--) {
-    lcd_buffer[parser->clear_from++] = ' ';
-  }
+  lcd_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+  int val;
 
-  parser->state_fn = wsp_copy;
+  switch (cmd) {
+  case ADA_IOC_COMMIT:
+    lcd_commit(ada, fs->screen);
+    return 0;
+  case ADA_IOC_SYNC:
+    lcd_commit(ada, fs->screen);
+    return lcd_sync(ada);
+  case ADA_IOC_CELLS:
+    if (get_user(val, (int __user *)arg)) return -EFAULT;
+    fs->cells = val != 0;
+    filp->f_pos = 0;
+    return 0;
+  case ADA_IOC_SCREEN:
+    if (get_user(val, (int __user *)arg)) return -EFAULT;
+    if (val == ADA_SCREEN_OVERLAY) {
+      val = LCD_OVERLAY;
+    } else if (val < 0 || val >= screens) {
+      return -EINVAL;
+    }
+    mutex_lock(&fs->write_lock);
+    mutex_lock(&ada->lcd_lock);
+    fs->screen = val;
+    fs->seen_gen = ada->lcd_screen_gen[val];
+    wsp_init(&fs->parser, ada, val);
+    mutex_unlock(&ada->lcd_lock);
+    mutex_unlock(&fs->write_lock);
+    return 0;
+  case ADA_IOC_SHOW:
+    if (get_user(val, (int __user *)arg)) return -EFAULT;
+    if (val < 0 || val >= screens) return -EINVAL;
+    mutex_lock(&ada->lcd_lock);
+    lcd_show_locked(ada, val, ada->lcd_overlay_on);
+    mutex_unlock(&ada->lcd_lock);
+    return 0;
+  case ADA_IOC_GLYPH: {
+    struct ada_glyph glyph;
+    if (copy_from_user(&glyph, (void __user *)arg, sizeof(glyph))) return -EFAULT;
+
+    u64 bitmap = 0;
+    for (int r = 0; r < 8; ++r) {
+      bitmap |= (u64)(glyph.rows[r] & 0x1F) << (8 * r);
+    }
+
+    mutex_lock(&ada->lcd_lock);
+    val = lcd_glyph_get(ada, bitmap);
+    mutex_unlock(&ada->lcd_lock);
+    if (val < 0) return val;
+
+    // The upload goes with the flush that shows the glyph
+    glyph.code = val;
+    if (copy_to_user((void __user *)arg, &glyph, sizeof(glyph))) return -EFAULT;
+    return 0;
+  }
+  case ADA_IOC_OVERLAY:
+    if (get_user(val, (int __user *)arg)) return -EFAULT;
+    mutex_lock(&ada->lcd_lock);
+    lcd_show_locked(ada, ada->lcd_active, val != 0);
+    mutex_unlock(&ada->lcd_lock);
+    return 0;
+  default:
+    return -ENOTTY;
+  }
 }
 
-static void wsp_csi(write_stream_parser_t *parser)
+// Readable when its screen changed since this file last read it
+static unsigned int lcd_poll(struct file *filp, poll_table *wait)
 {
-  // Ignore lone ESC, assume next character is printable
-  // even though in real ANSI that isn't really so
-  if (parser->buffer[parser->index] != '[') {
-    parser->state_fn = wsp_copy;
-    return;
-  }
+  lcd_file_state_t *fs = filp->private_data;
+  struct ada *ada = fs->ada;
+  unsigned int mask = POLLOUT | POLLWRNORM;
 
-  ++parser->index;
-  
-  parser->ansi_n = 0;
-  if (parser->buffer[parser->index] == ';') {
-    parser->ansi_n = 1;
+  poll_wait(filp, &ada->lcd_changeq, wait);
+
+  if (ACCESS_ONCE(ada->gone)) {
+    return POLLERR | POLLHUP;
   }
-  parser->ansi_m = 0;
-  parser->state_fn = wsp_ansi_n;  
+  if (ACCESS_ONCE(ada->lcd_screen_gen[fs->screen]) != fs->seen_gen) {
+    mask |= POLLIN | POLLRDNORM | POLLPRI;
+  }
+  return mask;
 }
 
-static void wsp_ansi_n(write_stream_parser_t *parser)
+static int lcd_fasync(int fd, struct file *filp, int on)
 {
-  if ('0' <= parser->buffer[parser->index] &&
-      parser->buffer[parser->index] <= '9' ) {
-    parser->ansi_n *= 10;
-    parser->ansi_n += parser->buffer[parser->index] - '0';
-    ++parser->index;
-    return;
-  }
+  lcd_file_state_t *fs = filp->private_data;
 
-  if (parser->buffer[parser->index] == ';') {
-    ++parser->index;
+  return fasync_helper(fd, filp, on, &fs->ada->lcd_fasync_queue);
+}
 
-    if (parser->buffer[parser->index] < '0' ||
-	'9' < parser->buffer[parser->index] ) {
-      parser->ansi_m = 1;
-    }
+static int lcd_release(struct inode *inode, struct file *filp)
+{
+  lcd_file_state_t *fs = filp->private_data;
 
-    parser->state_fn = wsp_ansi_m;
-    return;
-  }
+  lcd_fasync(-1, filp, 0);
+  ada_put(fs->ada);
+  kfree(fs);
+  return 0;
+}
 
-  if (parser->buffer[parser->index] == 'J') {
-    ++parser->index;
-    parser->state_fn = wsp_ed;
-    return;
-  }
+static struct file_operations lcd_fileops = {
+  .owner = THIS_MODULE,
+  .open = lcd_open,
+  .read = lcd_read,
+  .write = lcd_write,
+  .llseek = lcd_llseek,
+  .fsync = lcd_fsync,
+  .mmap = lcd_mmap,
+  .poll = lcd_poll,
+  .fasync = lcd_fasync,
+  .unlocked_ioctl = lcd_ioctl,
+  .release = lcd_release
+};
 
-  // Others treated as normal text
-  parser->state_fn = wsp_copy;
-}
+/************************************************************
+ * Device data
+ */
+
+// One region for all panels: /dev/adalcdN is minor N and
+// /dev/adabutN minor ADA_PANELS_MAX + N
+static struct class *class;
+static dev_t ada_devnum;
+static struct cdev lcd_cdev;
+static struct cdev but_cdev;
+
+/************************************************************
+ * Panel life cycle
+ */
 
-static void wsp_ansi_m(write_stream_parser_t *parser)
+// A panel on the expander of client, or with no client on the
+// mock. Only the panel memory, the flush queue and the files
+// are needed for it to work, a panel that can't reach its
+// expander still comes up and shows nothing.
+static struct ada *ada_create(struct i2c_client *client,
+			      const struct port_backend *backend)
 {
-  if ('0' <= parser->buffer[parser->index] &&
-      parser->buffer[parser->index] <= '9' ) {
-    parser->ansi_m *= 10;
-    parser->ansi_m += parser->buffer[parser->index] - '0';
-    ++parser->index;
-    return;
+  struct ada *ada = NULL;
+  int index;
+  int err = 0;
+
+  mutex_lock(&ada_panels_lock);
+
+  for (index = 0; index < ADA_PANELS_MAX && ada_panels[index]; ++index) {
+  }
+  if (index == ADA_PANELS_MAX) {
+    err = -ENOSPC;
+    goto alloc_fail;
   }
 
-  if (parser->buffer[parser->index] == 'H') {
-    ++parser->index;
-    parser->state_fn = wsp_cup;
-    return;
+  ada = kzalloc(sizeof(*ada), GFP_KERNEL);
+  if (!ada) {
+    err = -ENOMEM;
+    goto alloc_fail;
   }
 
-  // Others treated as normal text
-  parser->state_fn = wsp_copy;
-}
+  kref_init(&ada->ref);
+  ada->index = index;
+  ada->client = client;
+  ada->backend = backend;
+  mutex_init(&ada->port_lock);
+  mutex_init(&ada->lcd_lock);
+  mutex_init(&ada->but_read_lock);
+  mutex_init(&ada->button_lock);
+  init_waitqueue_head(&ada->but_readq);
+  init_waitqueue_head(&ada->lcd_changeq);
+  init_waitqueue_head(&ada->lcd_flushq);
+  init_waitqueue_head(&ada->lcd_readyq);
+  ada->lcd_size = lcd_size;
+  ada->marquee = marquee;
+
+  err = lcd_buffer_init(ada);
+  if (err) {
+    goto buffer_fail;
+  }
 
-static void wsp_ed(write_stream_parser_t *parser)
-{
-  int lcd_index = parser->col + parser->row * 80 / NROWS;
+  // Panels on one adapter share its bus, the mock panels theirs
+  ada->bus = bus_get(client ? client->adapter->nr : -1);
+  if (!ada->bus) {
+    err = -ENOMEM;
+    goto buffer_fail;
+  }
 
-  switch (parser->ansi_n) {
-  case 0:
-    // n == 0: clear form cursor to end
-    parser->clear_from = lcd_index;
-    parser->clear_count = 80 - lcd_index;
-    break;
-  case 1:
-    // n == 1: clear from beginning to cursor
-    parser->clear_from = 0;
-    parser->clear_count = lcd_index + 1;
-    break;
-  case 2:
-    // n == 2: clear entire screen
-    parser->clear_from = 0;
-    parser->clear_count = 80;
-    break;
+  stats_init(&ada->stats, index);
+  err = port_backend_init(ada);
+  if (err) {
+    printk(KERN_ALERT MODULE_NAME "%d: no %s backend (%d)\n", index,
+	   backend->name, err);
   }
-  parser->state_fn = wsp_clear;
-}
+  err = port_init(ada, BL_PINS, 0xFFFF & ~(BL_PINS | LCD_PINS), BUTTON_PINS);
+  if (err) {
+    printk(KERN_ALERT MODULE_NAME "%d: no access to port latches (%d)\n",
+	   index, err);
+  }
+  bl_color_set(ada, bl_color);
 
-static void wsp_cup(write_stream_parser_t *parser)
-{
-  // go to n,m (n, m are 1 based)
-  int row = parser->ansi_n - 1;
-  int col = parser->ansi_m - 1;
-  if (row >= NROWS) {
-    row = NROWS - 1;
+  err = flusher_init(ada);
+  if (err) {
+    goto flusher_fail;
   }
-  if (col >= NCOLS) {
-    col = NCOLS - 1;
+  err = button_input_init(ada);
+  if (err) {
+    printk(KERN_ALERT MODULE_NAME "%d: no input device (%d)\n", index, err);
+  }
+  err = scanner_init(ada);
+  if (err) {
+    goto scanner_fail;
   }
-  parser->row = row;
-  parser->col = col;
 
-  parser->state_fn = wsp_copy;
-}
+  // Create devices to /dev
+  struct device *parent = client ? &client->dev : NULL;
 
-/* Parser state driver */
+  ada->lcd_dev = device_create(class, parent, MKDEV(MAJOR(ada_devnum), index),
+			       ada, MODULE_NAME "lcd%d", index);
+  if (IS_ERR(ada->lcd_dev)) {
+    err = PTR_ERR(ada->lcd_dev);
+    goto lcd_dev_create_fail;
+  }
 
-static void wsp_init(write_stream_parser_t *parser)
-{
-  parser->col = 0;
-  parser->row = 0;
-  parser->len = 0;
-  parser->state_fn = wsp_copy;
-} 
+  ada->but_dev = device_create(class, parent,
+			       MKDEV(MAJOR(ada_devnum), ADA_PANELS_MAX + index),
+			       ada, MODULE_NAME "but%d", index);
+  if (IS_ERR(ada->but_dev)) {
+    err = PTR_ERR(ada->but_dev);
+    goto but_dev_create_fail;
+  }
+
+  // All OK
+  ada_panels[index] = ada;
+  mutex_unlock(&ada_panels_lock);
+
+  return ada;
 
-static void wsp_process_init(write_stream_parser_t *parser, const char *buffer, size_t len)
+ but_dev_create_fail:
+  device_destroy(class, MKDEV(MAJOR(ada_devnum), index));
+
+ lcd_dev_create_fail:
+  scanner_exit(ada);
+
+ scanner_fail:
+  button_input_exit(ada);
+  flusher_exit(ada);
+
+ flusher_fail:
+  port_exit(ada, BL_PINS);
+  stats_exit(&ada->stats);
+  port_backend_exit(ada);
+
+ buffer_fail:
+  ada_put(ada);
+
+ alloc_fail:
+  mutex_unlock(&ada_panels_lock);
+
+  return ERR_PTR(err);
+}
+
+// Files still open keep the panel memory until they are closed,
+// see ada_release(). The expander is left alone from here on.
+static void ada_destroy(struct ada *ada)
 {
-  parser->buffer = buffer;
-  parser->len = len;
-  parser->index = 0;
-} 
+  mutex_lock(&ada_panels_lock);
+  ada_panels[ada->index] = NULL;
+  mutex_unlock(&ada_panels_lock);
+
+  // Nothing wakes those waiting for the panel any more
+  ACCESS_ONCE(ada->gone) = true;
+  wake_up_interruptible_all(&ada->lcd_readyq);
+  wake_up_interruptible_all(&ada->but_readq);
+  wake_up_interruptible_all(&ada->lcd_changeq);
+
+  device_destroy(class, MKDEV(MAJOR(ada_devnum), ADA_PANELS_MAX + ada->index));
+  device_destroy(class, MKDEV(MAJOR(ada_devnum), ada->index));
+
+  scanner_exit(ada);
+  button_input_exit(ada);
+  flusher_exit(ada);
+  port_exit(ada, BL_PINS);
+  // The mock has files in the statistics directory
+  stats_exit(&ada->stats);
+  port_backend_exit(ada);
+
+  ada_put(ada);
+}
 
-static void wsp_process(write_stream_parser_t *parser)
+static void ada_release(struct kref *ref)
 {
-  while (parser->index < parser->len) {
-    parser->state_fn(parser);
+  struct ada *ada = container_of(ref, struct ada, ref);
+
+  // Files open past ada_destroy() may have queued flushes, and
+  // destroy_workqueue() leaves the timers of delayed work running
+  if (ada->flusher_q) {
+    cancel_delayed_work_sync(&ada->flusher_w);
+    cancel_delayed_work_sync(&ada->marquee_w);
+    destroy_workqueue(ada->flusher_q);
+  }
+  if (ada->bus) {
+    bus_put(ada->bus);
   }
+  lcd_buffer_exit(ada);
+  kfree(ada);
 }
 
 /************************************************************
- * LCD file ops
+ * I2C driver
  */
 
-typedef enum {
-  DO_READ,
-  READ_DONE
-} lcd_read_state_e;
-
-typedef struct {
-  write_stream_parser_t parser;
-  lcd_read_state_e read_state;
-} lcd_file_state_t;
+// Binds to an MCP23017 declared in the device tree, by board
+// code or from user space, e.g.
+// echo ada1110 0x21 > /sys/bus/i2c/devices/i2c-1/new_device
+// Its irq, if any, is the expander's INTA.
 
-static int lcd_open(struct inode *inode, struct file *filp)
+static int ada_probe(struct i2c_client *client, const struct i2c_device_id *id)
 {
-  lcd_file_state_t *fs = kmalloc(sizeof(lcd_file_state_t), GFP_KERNEL);
-  if (!fs) return -ENOMEM;
+  struct ada *ada = ada_create(client, &mcp23017_backend);
+  if (IS_ERR(ada)) return PTR_ERR(ada);
 
-  filp->private_data = fs;
-
-  fs->read_state = DO_READ;
-  wsp_init(&fs->parser);
+  i2c_set_clientdata(client, ada);
 
   return 0;
 }
 
-static ssize_t lcd_read(
-    struct file *filp, char __user *ubuff, size_t len, loff_t *offs)
+static int ada_remove(struct i2c_client *client)
 {
-  lcd_file_state_t *fs = filp->private_data;
-  if (fs->read_state == READ_DONE) {
-    fs->read_state = DO_READ;
-    return 0;
-  }
+  ada_destroy(i2c_get_clientdata(client));
 
-  int ret = 0;
-  char *buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  return 0;
+}
 
-  if (!buffer) return -ENOMEM;
+static const struct i2c_device_id ada_id[] = {
+  { "ada1110", 0 },
+  { }
+};
 
-  int blen = output_display(buffer, lcd_buffer);
+MODULE_DEVICE_TABLE(i2c, ada_id);
 
-  if (blen < len) {
-    len = blen;
-  }
+static const struct of_device_id ada_of_match[] = {
+  { .compatible = "adafruit,ada1110" },
+  { }
+};
 
-  int uncopied = copy_to_user(ubuff, buffer, len);
+MODULE_DEVICE_TABLE(of, ada_of_match);
+
+static struct i2c_driver ada_driver = {
+  .driver = {
+    .name = MODULE_NAME,
+    .owner = THIS_MODULE,
+    .of_match_table = ada_of_match
+  },
+  .probe = ada_probe,
+  .remove = ada_remove,
+  .id_table = ada_id
+};
 
-  if (uncopied) {
-    ret = -EFAULT;
-  } else {
-    ret = len;
-  }
+/* Panel at load */
 
-  kfree(buffer);
+// A panel at i2c_addr on bus i2c_bus is declared at load, as the
+// module always did, -1 for none. With backend=mock, mock_panels
+// panels are created instead.
+static int i2c_bus = 1;
+static unsigned short i2c_addr = 0x20;
 
-  fs->read_state = READ_DONE;
+module_param(i2c_bus, int, 0444);
+module_param(i2c_addr, ushort, 0444);
 
-  return ret;
-}
+// Interrupt driven input for that panel: the expander's INT
+// output (port A, active low) is wired to host GPIO irq_gpio.
+// Negative irq_gpio or failing to get the interrupt means polling.
+static int irq_gpio = -1;
 
-static ssize_t lcd_write(struct file *filp, const char __user *ubuff, size_t len, loff_t *offs)
-{
-  lcd_file_state_t *fs = filp->private_data;
+module_param(irq_gpio, int, 0444);
 
-  char *buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
-  if (!buffer) return -ENOMEM;
+static struct i2c_client *ada_legacy_client;
+static struct ada *mock_ada[ADA_PANELS_MAX];
 
-  int ret = 0;
+static int ada_legacy_init(void)
+{
+  struct i2c_board_info info = { I2C_BOARD_INFO("ada1110", i2c_addr) };
+  int err = 0;
 
-  if (len > PAGE_SIZE) {
-    len = PAGE_SIZE;
+  if (irq_gpio >= 0) {
+    err = gpio_request_one(irq_gpio, GPIOF_IN, MODULE_NAME " int");
+    if (err) return err;
+
+    info.irq = gpio_to_irq(irq_gpio);
+    if (info.irq < 0) {
+      printk(KERN_ALERT MODULE_NAME ": no irq for gpio %d\n", irq_gpio);
+      info.irq = 0;
+    }
   }
 
-  int uncopied = copy_from_user(buffer, ubuff, len);
+  struct i2c_adapter *adapter = i2c_get_adapter(i2c_bus);
+  if (!adapter) {
+    err = -ENODEV;
+    goto adapter_fail;
+  }
 
-  if (uncopied) {
-    ret = -EFAULT;
-  } else {
-    ret = len;
+  ada_legacy_client = i2c_new_device(adapter, &info);
+  i2c_put_adapter(adapter);
+  if (!ada_legacy_client) {
+    err = -ENODEV;
+    goto adapter_fail;
   }
 
-  wsp_process_init(&fs->parser, buffer, len);
-  wsp_process(&fs->parser);
-  lcd_write_to_panel();
+  return 0;
 
-  kfree(buffer);
+ adapter_fail:
+  if (irq_gpio >= 0) {
+    gpio_free(irq_gpio);
+  }
 
-  return ret;
+  return err;
 }
 
-static int lcd_release(struct inode *inode, struct file *filp)
+static void ada_legacy_exit(void)
 {
-  if (filp->private_data) {
-    kfree(filp->private_data);
+  if (ada_legacy_client) {
+    i2c_unregister_device(ada_legacy_client);
+    ada_legacy_client = NULL;
+    if (irq_gpio >= 0) {
+      gpio_free(irq_gpio);
+    }
   }
-  return 0;
 }
 
-static struct file_operations lcd_fileops = {
-  .owner = THIS_MODULE,
-  .open = lcd_open,
-  .read = lcd_read,
-  .write = lcd_write,
-  .release = lcd_release
-};
-
-/************************************************************
- * Device data
- */
-
-static struct class *class;
-static dev_t but_devnum;
-static dev_t lcd_devnum;
-struct cdev but_cdev;
-struct cdev lcd_cdev;
-struct device *but_dev;
-struct device *lcd_dev;
-
 /************************************************************
  * Init and exit
  */
@@ -884,62 +4630,76 @@ static int ada_init(void)
 {
   int err = 0;
 
+  err = port_backend_select();
+  if (err) {
+    return err;
+  }
+
+  if (screens < 1 || screens > LCD_SCREENS_MAX) {
+    printk(KERN_ALERT MODULE_NAME ": screens must be 1...%d\n",
+	   LCD_SCREENS_MAX);
+    return -EINVAL;
+  }
+
+  lcd_burst_table_init();
+
   // Create device class
   class = class_create(THIS_MODULE, MODULE_NAME);
 
-  // Allocate device number
-  err = alloc_chrdev_region(&lcd_devnum, 0, 2, MODULE_NAME);
+  // Allocate device numbers
+  err = alloc_chrdev_region(&ada_devnum, 0, 2 * ADA_PANELS_MAX, MODULE_NAME);
   if (err) {
     goto devnum_fail;
   }
-  but_devnum = MKDEV(MAJOR(lcd_devnum), MINOR(lcd_devnum)+1);
 
-  // Create cdev
+  // Create cdevs
   cdev_init(&lcd_cdev, &lcd_fileops);
-  err = cdev_add(&lcd_cdev, lcd_devnum, 1);
+  err = cdev_add(&lcd_cdev, ada_devnum, ADA_PANELS_MAX);
   if (err) {
     goto lcd_dev_add_fail;
   }
   cdev_init(&but_cdev, &but_fileops);
-  err = cdev_add(&but_cdev, but_devnum, 1);
+  err = cdev_add(&but_cdev, MKDEV(MAJOR(ada_devnum), ADA_PANELS_MAX),
+		 ADA_PANELS_MAX);
   if (err) {
     goto but_dev_add_fail;
   }
 
-  // Create devices to /dev
-  lcd_dev = device_create(class, NULL, lcd_devnum, NULL, MODULE_NAME "lcd");
-  if (IS_ERR(lcd_dev)) {
-    err = PTR_ERR(lcd_dev);
-    goto lcd_dev_create_fail;
+  stats_root_init();
+  err = i2c_add_driver(&ada_driver);
+  if (err) {
+    goto driver_fail;
   }
 
-  but_dev = device_create(class, NULL, but_devnum, NULL, MODULE_NAME "but");
-  if (IS_ERR(but_dev)) {
-    err = PTR_ERR(but_dev);
-    goto but_dev_create_fail;
+  // Panels at load, the module works without them
+  if (port_backend == &mock_backend) {
+    for (int i = 0; i < mock_panels && i < ADA_PANELS_MAX; ++i) {
+      struct ada *ada = ada_create(NULL, &mock_backend);
+      if (IS_ERR(ada)) {
+	printk(KERN_ALERT MODULE_NAME ": no mock panel (%ld)\n", PTR_ERR(ada));
+	break;
+      }
+      mock_ada[i] = ada;
+    }
+  } else if (i2c_bus >= 0) {
+    err = ada_legacy_init();
+    if (err) {
+      printk(KERN_ALERT MODULE_NAME ": no panel on i2c-%d (%d)\n", i2c_bus, err);
+      err = 0;
+    }
   }
 
-  // All OK
-  init_waitqueue_head(&but_readq);
-  ioexpander_init();
-  bl_init();
-  buttons_init();
-  lcd_init();
-  scanner_init();
-
   return 0;
 
- but_dev_create_fail:
-  device_destroy(class, lcd_devnum);
-
- lcd_dev_create_fail:
+ driver_fail:
+  stats_root_exit();
   cdev_del(&but_cdev);
 
  but_dev_add_fail:
   cdev_del(&lcd_cdev);
 
  lcd_dev_add_fail:
-  unregister_chrdev_region(lcd_devnum, 2);  
+  unregister_chrdev_region(ada_devnum, 2 * ADA_PANELS_MAX);
 
  devnum_fail:
   class_destroy(class);
@@ -950,18 +4710,20 @@ static int ada_init(void)
 static void ada_exit(void)
 {
   printk(KERN_ALERT "---exit\n");  
-  
-  scanner_exit();
-  lcd_exit();
-  buttons_exit();
-  bl_exit();
-  ioexpander_exit();
-
-  device_destroy(class, but_devnum);
-  device_destroy(class, lcd_devnum);
+
+  for (int i = 0; i < ADA_PANELS_MAX; ++i) {
+    if (mock_ada[i]) {
+      ada_destroy(mock_ada[i]);
+      mock_ada[i] = NULL;
+    }
+  }
+  ada_legacy_exit();
+  i2c_del_driver(&ada_driver);
+
+  stats_root_exit();
   cdev_del(&but_cdev);
   cdev_del(&lcd_cdev); 
-  unregister_chrdev_region(lcd_devnum, 2);  
+  unregister_chrdev_region(ada_devnum, 2 * ADA_PANELS_MAX);  
   class_destroy(class);
 }
 
@@ -0,0 +1,105 @@
+/* Adafruit 1110 LCD and button driver,
+ * user space interface.
+ */
+
+#ifndef ADA_H
+#define ADA_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ADA_IOC_MAGIC 'a'
+
+/* /dev/adalcdN */
+
+// Cells of a screen. mmap() of /dev/adalcdN gives those of screen
+// 0 at offset 0: line n starts at n * 40 on a 2-line display and at
+// n * 20 on a 4-line display.
+#define ADA_LCD_CELLS 80
+
+// Virtual screens. Every open file writes to and reads from one
+// of them, screen 0 unless ADA_IOC_SCREEN attaches it elsewhere.
+// The panel shows the active screen, or the overlay while it is
+// on. In a mapping the cells of screen n are at n * ADA_LCD_CELLS
+// and those of the overlay at ADA_LCD_SCREENS_MAX * ADA_LCD_CELLS.
+#define ADA_LCD_SCREENS_MAX 8
+#define ADA_SCREEN_OVERLAY (-1)
+
+// Wait until everything written so far, also through a mapping,
+// is on the panel. Same as fsync() and msync(MS_SYNC).
+#define ADA_IOC_SYNC _IO(ADA_IOC_MAGIC, 0)
+
+// Show changes made through a mapping to the screen of this
+// file, don't wait
+#define ADA_IOC_COMMIT _IO(ADA_IOC_MAGIC, 1)
+
+// Mode of this open file, int argument. 0 is text (default):
+// writes are a stream with ANSI escapes, reads give the display
+// as lines of text from the file offset on. 1 is cells: the file
+// offset is row * columns + col of the current geometry, write()
+// or pwrite() store the bytes in those cells as they are, without
+// wrapping or scrolling, and reads give the cells. Writes past the
+// last cell fail with ENOSPC.
+#define ADA_IOC_CELLS _IOW(ADA_IOC_MAGIC, 2, int)
+
+// Screen this open file writes to and reads from, int argument:
+// 0... or ADA_SCREEN_OVERLAY. The cursor starts at the top left.
+#define ADA_IOC_SCREEN _IOW(ADA_IOC_MAGIC, 3, int)
+
+// Make a screen the active one, int argument: 0... Buttons
+// SELECT+RIGHT and SELECT+LEFT pressed together step through them.
+#define ADA_IOC_SHOW _IOW(ADA_IOC_MAGIC, 4, int)
+
+// Show the overlay over the active screen or hide it, int
+// argument: 1 or 0
+#define ADA_IOC_OVERLAY _IOW(ADA_IOC_MAGIC, 5, int)
+
+// Custom glyph, 5x8 dots: rows from the top, the leftmost dot in
+// bit 4. ADA_IOC_GLYPH returns in code the character, 0...7, that
+// shows it. The eight glyph slots are a cache: a glyph already
+// loaded costs nothing, and a slot is reused only when no screen
+// shows it, so get the code again before each use. Fails with
+// ENOSPC when all eight slots are on some screen. The escape
+// ESC[r0;r1;...;r7g puts a glyph at the cursor of a text stream.
+struct ada_glyph {
+  __u8 rows[8];
+  __s32 code;
+};
+
+#define ADA_IOC_GLYPH _IOWR(ADA_IOC_MAGIC, 6, struct ada_glyph)
+
+/* /dev/adabutN */
+
+// Buttons
+#define ADA_BUTTON_SELECT 0
+#define ADA_BUTTON_RIGHT  1
+#define ADA_BUTTON_DOWN   2
+#define ADA_BUTTON_UP     3
+#define ADA_BUTTON_LEFT   4
+
+// Event types. LONG comes once when a button has been held for
+// long_press_ms, REPEAT every 1/repeat_rate s after repeat_delay_ms
+// (module parameters, 0 turns them off). CHORD comes when a press
+// makes two or more buttons held, button is the one pressed and
+// state all of them. Buttons of a chord get no LONG or REPEAT.
+#define ADA_BUTTON_RELEASE 0
+#define ADA_BUTTON_PRESS   1
+#define ADA_BUTTON_LONG    2
+#define ADA_BUTTON_REPEAT  3
+#define ADA_BUTTON_CHORD   4
+
+// Event record read in binary mode, reads return as many whole
+// records as are pending and fit
+struct ada_button_event {
+  __u64 time_ns;      // CLOCK_MONOTONIC
+  __u8 button;        // ADA_BUTTON_SELECT...
+  __u8 type;          // ADA_BUTTON_PRESS...
+  __u8 state;         // Buttons held after the event, bit per button
+  __u8 reserved[5];
+};
+
+// Read format of this open file, int argument: 0 is text, one
+// digit per press or repeat followed by EOF (default), 1 is binary
+#define ADA_IOC_BUT_BINARY _IOW(ADA_IOC_MAGIC, 16, int)
+
+#endif
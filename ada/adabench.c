@@ -0,0 +1,372 @@
+/* Throughput and latency benchmark for /dev/adalcdN and
+ * /dev/adabutN.
+ *
+ * adabench [-d panel] [-w workload] [-n count] [-s]
+ *          [-o text|csv|json] [-l label] [-q]
+ *
+ * -d picks the panel, 0 by default.
+ *
+ * Workloads on /dev/adalcdN:
+ *   full    redraw the whole display as a text stream
+ *   cell    change one cell with pwrite() in cells mode
+ *   log     scroll lines of a log
+ *   ansi    cursor movement before every character
+ * With -s every write is followed by ADA_IOC_SYNC and the latency
+ * is the time until the frame is on the panel, otherwise it is
+ * that of write() alone.
+ *
+ *   button  press and release a button of the mock backend
+ *           (insmod ada.ko backend=mock) through its mock_buttons
+ *           parameter, the latency is from the press to read() of
+ *           the event from /dev/adabutN. mock_buttons presses
+ *           the buttons of every mock panel.
+ *
+ * One result per run. CSV has a header line unless -q is given, so
+ * runs of different driver versions can be appended to one file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "ada.h"
+
+#define PARAMS "/sys/module/ada/parameters/"
+
+// Device files of the panel, see -d
+static char lcd_dev[32] = "/dev/adalcd0";
+static char but_dev[32] = "/dev/adabut0";
+
+struct result {
+  const char *workload;
+  long count;
+  long long bytes;
+  double seconds;
+  long long *latency_ns;
+};
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int param_read(const char *name, char *buf, int len)
+{
+  FILE *f = fopen(name, "r");
+  if (!f) return -errno;
+
+  if (!fgets(buf, len, f)) {
+    fclose(f);
+    return -EIO;
+  }
+  fclose(f);
+
+  buf[strcspn(buf, "\n")] = 0;
+  return 0;
+}
+
+static int param_write(const char *name, const char *value)
+{
+  int fd = open(name, O_WRONLY);
+  if (fd < 0) return -errno;
+
+  int err = write(fd, value, strlen(value)) < 0 ? -errno : 0;
+  close(fd);
+  return err;
+}
+
+/* Display workloads */
+
+static int characters = 16;
+static int lines = 2;
+
+// Bytes of step i of a workload into buf, returns the length
+static int workload_full(char *buf, long i)
+{
+  int len = sprintf(buf, "\x1b[H");
+
+  for (int line = 0; line < lines; ++line) {
+    char text[96];
+    snprintf(text, sizeof(text), "%d:%0*ld", line, characters - 2, i);
+    len += sprintf(buf + len, "%.*s", characters, text);
+    if (line < lines - 1) {
+      buf[len++] = '\n';
+    }
+  }
+
+  return len;
+}
+
+static int workload_log(char *buf, long i)
+{
+  return sprintf(buf, "\nlog %ld", i);
+}
+
+static int workload_ansi(char *buf, long i)
+{
+  int len = 0;
+
+  for (int k = 0; k < characters; ++k) {
+    int line = (i + k) % lines;
+    int col = (i * 7 + k * 3) % characters;
+    len += sprintf(buf + len, "\x1b[%d;%dH%c", line + 1, col + 1,
+		   'A' + (int)((i + k) % 26));
+  }
+
+  return len;
+}
+
+static int bench_lcd(const char *workload, long count, int sync,
+		     struct result *r)
+{
+  int fd = open(lcd_dev, O_RDWR);
+  if (fd < 0) {
+    perror(lcd_dev);
+    return -1;
+  }
+
+  int cells = !strcmp(workload, "cell");
+  if (cells && ioctl(fd, ADA_IOC_CELLS, 1)) {
+    perror("ADA_IOC_CELLS");
+    close(fd);
+    return -1;
+  }
+
+  // Clear first so every run starts from the same display
+  if (!cells && write(fd, "\x1b[2J", 4) < 0) {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  ioctl(fd, ADA_IOC_SYNC);
+
+  char buf[1024];
+  long long start = now_ns();
+
+  for (long i = 0; i < count; ++i) {
+    int len;
+    if (cells) {
+      buf[0] = 'a' + i % 26;
+      len = 1;
+    } else if (!strcmp(workload, "full")) {
+      len = workload_full(buf, i);
+    } else if (!strcmp(workload, "log")) {
+      len = workload_log(buf, i);
+    } else {
+      len = workload_ansi(buf, i);
+    }
+
+    long long t = now_ns();
+    ssize_t n;
+    if (cells) {
+      n = pwrite(fd, buf, len, (i * 7) % (characters * lines));
+    } else {
+      n = write(fd, buf, len);
+    }
+    if (n < 0 || (sync && ioctl(fd, ADA_IOC_SYNC))) {
+      perror(workload);
+      close(fd);
+      return -1;
+    }
+    r->latency_ns[i] = now_ns() - t;
+    r->bytes += n;
+  }
+
+  ioctl(fd, ADA_IOC_SYNC);
+  r->seconds = (now_ns() - start) / 1e9;
+
+  close(fd);
+  return 0;
+}
+
+/* Button workload */
+
+static int bench_buttons(long count, struct result *r)
+{
+  char value[32];
+  if (param_read(PARAMS "backend", value, sizeof(value)) || strcmp(value, "mock")) {
+    fprintf(stderr, "button needs ada loaded with backend=mock\n");
+    return -1;
+  }
+
+  int fd = open(but_dev, O_RDONLY);
+  if (fd < 0) {
+    perror(but_dev);
+    return -1;
+  }
+  if (ioctl(fd, ADA_IOC_BUT_BINARY, 1)) {
+    perror("ADA_IOC_BUT_BINARY");
+    close(fd);
+    return -1;
+  }
+
+  long long start = now_ns();
+  int err = 0;
+
+  for (long i = 0; i < count && !err; ++i) {
+    int button = i % 5;
+
+    // Press, then release once the press was read
+    for (int press = 1; press >= 0 && !err; --press) {
+      sprintf(value, "%d", press ? 0x1F & ~(1 << button) : 0x1F);
+
+      long long t = now_ns();
+      err = param_write(PARAMS "mock_buttons", value);
+      if (err) {
+	fprintf(stderr, "mock_buttons: %s\n", strerror(-err));
+	break;
+      }
+
+      struct ada_button_event ev;
+      do {
+	if (read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+	  perror(but_dev);
+	  err = -1;
+	  break;
+	}
+      } while (ev.button != button ||
+	       ev.type != (press ? ADA_BUTTON_PRESS : ADA_BUTTON_RELEASE));
+
+      if (press && !err) {
+	r->latency_ns[i] = now_ns() - t;
+	r->bytes += sizeof(ev);
+      }
+    }
+  }
+
+  param_write(PARAMS "mock_buttons", "31");
+  r->seconds = (now_ns() - start) / 1e9;
+
+  close(fd);
+  return err;
+}
+
+/* Report */
+
+static int compare_ns(const void *a, const void *b)
+{
+  long long x = *(const long long *)a;
+  long long y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct result *r, int p)
+{
+  if (!r->count) return 0;
+  return r->latency_ns[(r->count - 1) * p / 100] / 1e3;
+}
+
+static void report(const struct result *r, const char *format,
+		   const char *label, int header)
+{
+  qsort(r->latency_ns, r->count, sizeof(r->latency_ns[0]), compare_ns);
+
+  double per_s = r->seconds > 0 ? r->count / r->seconds : 0;
+  double bytes_per_s = r->seconds > 0 ? r->bytes / r->seconds : 0;
+  double p50 = percentile_us(r, 50);
+  double p90 = percentile_us(r, 90);
+  double p99 = percentile_us(r, 99);
+  double max = percentile_us(r, 100);
+
+  if (!strcmp(format, "csv")) {
+    if (header) {
+      printf("label,workload,count,bytes,seconds,ops_per_s,bytes_per_s,"
+	     "p50_us,p90_us,p99_us,max_us\n");
+    }
+    printf("%s,%s,%ld,%lld,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+	   label, r->workload, r->count, r->bytes, r->seconds,
+	   per_s, bytes_per_s, p50, p90, p99, max);
+  } else if (!strcmp(format, "json")) {
+    printf("{\"label\": \"%s\", \"workload\": \"%s\", \"count\": %ld, "
+	   "\"bytes\": %lld, \"seconds\": %.6f, \"ops_per_s\": %.1f, "
+	   "\"bytes_per_s\": %.1f, \"latency_us\": {\"p50\": %.1f, "
+	   "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+	   label, r->workload, r->count, r->bytes, r->seconds,
+	   per_s, bytes_per_s, p50, p90, p99, max);
+  } else {
+    printf("%s: %ld in %.3f s, %.1f/s, %.1f bytes/s\n",
+	   r->workload, r->count, r->seconds, per_s, bytes_per_s);
+    printf("latency us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	   p50, p90, p99, max);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [-d panel] [-w full|cell|log|ansi|button] [-n count]\n"
+	  "       [-s] [-o text|csv|json] [-l label] [-q]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *workload = "full";
+  const char *format = "text";
+  const char *label = "ada";
+  long count = 1000;
+  int sync = 0;
+  int header = 1;
+  int panel = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:w:n:so:l:q")) != -1) {
+    switch (opt) {
+    case 'd': panel = atoi(optarg); break;
+    case 'w': workload = optarg; break;
+    case 'n': count = atol(optarg); break;
+    case 's': sync = 1; break;
+    case 'o': format = optarg; break;
+    case 'l': label = optarg; break;
+    case 'q': header = 0; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (count <= 0 || panel < 0 ||
+      (strcmp(workload, "full") && strcmp(workload, "cell") &&
+       strcmp(workload, "log") && strcmp(workload, "ansi") &&
+       strcmp(workload, "button"))) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  snprintf(lcd_dev, sizeof(lcd_dev), "/dev/adalcd%d", panel);
+  snprintf(but_dev, sizeof(but_dev), "/dev/adabut%d", panel);
+
+  // Geometry of the display, 16x2 if it can't be read. All panels
+  // have the one set through the parameter.
+  char size[32];
+  if (!param_read(PARAMS "lcd_size", size, sizeof(size))) {
+    sscanf(size, "%dx%d", &characters, &lines);
+  }
+
+  struct result r = { .workload = workload, .count = count };
+  r.latency_ns = calloc(count, sizeof(r.latency_ns[0]));
+  if (!r.latency_ns) {
+    perror("calloc");
+    return 1;
+  }
+
+  int err;
+  if (!strcmp(workload, "button")) {
+    err = bench_buttons(count, &r);
+  } else {
+    err = bench_lcd(workload, count, sync, &r);
+  }
+
+  if (!err) {
+    report(&r, format, label, header);
+  }
+
+  free(r.latency_ns);
+  return err ? 1 : 0;
+}